@@ -0,0 +1,324 @@
+// Per-turn trace lines are compiled out, as in a server built for load
+#define LOG_LEVEL LOG_LEVEL_WARNING
+#define ARENA_NO_SERVER_MAIN
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "game.h"
+#include "messages.h"
+#include "receive_buffer.h"
+#include "client_parsing.h"
+#include "server.cpp"
+
+// Microbenchmarks for the turn path and the client parsers. Every benchmark runs at several match
+// sizes, pass a substring to only run the benchmarks whose name contains it:
+//   ./bench            all of them
+//   ./bench Parse      client parsing only
+// Exits with 1 if a running match allocated during a turn, see benchRoom().
+
+using Clock = std::chrono::steady_clock;
+
+// Every heap allocation in the process goes through here, so a benchmark can report how many it made.
+// Only those of the benchmarking thread are counted, the logger's writer thread runs alongside it.
+// Not inlined, so the compiler does not pair the free() below with a new expression it can see.
+thread_local size_t allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+struct BenchConfig {
+    int players;
+    int width;
+    int height;
+};
+
+const BenchConfig kConfigs[] = {
+        {4, 24, 10},    // The original game
+        {16, 48, 20},
+        {64, 96, 40},
+        {255, 200, 100} // Largest match the protocol allows
+};
+
+// Keeps the compiler from optimizing away a result nobody reads
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+std::string filter;
+
+// Runs fn(i) in batches that double until one takes at least 100 ms, then reports the time and
+// heap allocations per call, which it also returns. Returns 0 for a benchmark the filter skips.
+template <typename Fn>
+double benchmark(const std::string& name, const BenchConfig& config, Fn fn) {
+    if (name.find(filter) == std::string::npos) return 0;
+
+    size_t iterations = 1;
+    size_t allocated;
+    Clock::duration elapsed;
+    while (true) {
+        allocated = allocations;
+        auto start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            fn(i);
+        }
+        elapsed = Clock::now() - start;
+        allocated = allocations - allocated;
+        if (elapsed >= std::chrono::milliseconds(100)) break;
+        iterations *= 2;
+    }
+    double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-24s %4d players %4dx%-4d %12.1f ns/op %10.1f allocs/op\n", name.c_str(), config.players, config.width,
+           config.height, nanoseconds, static_cast<double>(allocated) / iterations);
+    fflush(stdout);
+    return static_cast<double>(allocated) / iterations;
+}
+
+// Letters and digits only, the text formats use punctuation as separators
+const std::string kPlayerCharacters = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+GameState makeGame(const BenchConfig& config) {
+    GameState game(config.width, config.height);
+    std::vector<std::pair<int, int>> spawnPoints = generateSpawnPoints(config.players, config.width, config.height);
+    for (int i = 0; i < config.players; ++i) {
+        game.addPlayer("player" + std::to_string(i), kPlayerCharacters[i % kPlayerCharacters.size()],
+                       spawnPoints[i].first, spawnPoints[i].second, i % 4 + 1);
+    }
+    return game;
+}
+
+void benchServer(const BenchConfig& config) {
+    const std::string moves[] = {"UP", "RIGHT", "DOWN", "LEFT"};
+    const std::string attacks[] = {"E", "T", "Y", "F", "H", "C", "G", "B"};
+    const std::string commands[] = {"UP", "E", "DOWN", "h", "LEFT", "RIGHT", "b", "X"};
+
+    GameState game = makeGame(config);
+    benchmark("updatePlayerPosition", config, [&](size_t i) {
+        updatePlayerPosition(i % config.players, moves[(i / config.players) % 4], game);
+        keep(game.x[i % config.players]);
+    });
+
+    game = makeGame(config);
+    benchmark("processAttackCommand", config, [&](size_t i) {
+        int target = processAttackCommand(i % config.players, game, attacks[i % 8]);
+        if (target >= 0) {
+            // Bring the target back so every iteration sees the same match
+            game.flags[target] &= ~kPlayerEliminated;
+            game.grid.set(game.x[target], game.y[target], target);
+        }
+        keep(target);
+    });
+
+    benchmark("isAttackCommand", config, [&](size_t i) {
+        keep(isAttackCommand(commands[i % 8]));
+    });
+
+    game = makeGame(config);
+    benchmark("generatePositions", config, [&](size_t) {
+        keep(generatePositions(game).size());
+    });
+    benchmark("createMoveStatus", config, [&](size_t) {
+        keep(createMoveStatus(game).size());
+    });
+    benchmark("generateMoveStatus", config, [&](size_t) {
+        keep(generateMoveStatus(game).size());
+    });
+    std::string text;
+    benchmark("appendPositions", config, [&](size_t) {
+        text.clear();
+        appendPositions(text, game);
+        keep(text.size());
+    });
+
+    std::vector<PositionRecord> base, records;
+    for (int id = 0; id < game.playerCount(); ++id) {
+        base.push_back(makePositionRecord(game, id));
+    }
+    records = base;
+    for (size_t i = 0; i < records.size(); i += 2) {
+        records[i].x++; // Half the players moved
+    }
+    static uint8_t scratch[kMaxFrameSize];
+    benchmark("writePositions", config, [&](size_t i) {
+        FrameWriter writer(scratch, sizeof(scratch));
+        writePositions(writer, i, records);
+        keep(writer.length());
+    });
+    benchmark("writeDelta", config, [&](size_t i) {
+        FrameWriter writer(scratch, sizeof(scratch));
+        writeDelta(writer, i + 1, i, base, records);
+        keep(writer.length());
+    });
+
+    // With a view radius: the grid rebuilt, then every player's view and a delta of its own
+    InterestGrid interest;
+    interest.reset(config.width, config.height, 10, game.playerCount());
+    std::vector<PlayerSet> views(game.playerCount());
+    benchmark("interest (radius 10)", config, [&](size_t i) {
+        interest.rebuild(game);
+        size_t bytes = 0;
+        for (int id = 0; id < game.playerCount(); ++id) {
+            PlayerSet baseView = views[id];
+            interest.query(game, game.x[id], game.y[id], views[id]);
+            FrameWriter writer(scratch, sizeof(scratch));
+            writeDelta(writer, i + 1, i, base, baseView, records, views[id]);
+            bytes += writer.length();
+        }
+        keep(bytes);
+    });
+}
+
+// Reads everything the room sent to the clients, returns the number of bytes
+size_t drainClients(const std::vector<int>& clientEnds, uint8_t* buffer, size_t size) {
+    size_t total = 0;
+    for (int socket : clientEnds) {
+        ssize_t received;
+        while ((received = recv(socket, buffer, size, 0)) > 0) {
+            total += received;
+        }
+    }
+    return total;
+}
+
+// A whole turn of a real Room once the match is running: every player's command arriving, the move
+// list updates, resolving the turn, encoding the state and writing each client's outbox to a socket.
+// Player 0 speaks the text protocol, the others acknowledge every state so they get deltas. Returns
+// the allocations per turn, which should be 0.
+double benchRoom(const BenchConfig& config) {
+    static const int kWarmupTurns = 8;
+
+    MatchSettings settings;
+    settings.width = config.width;
+    settings.height = config.height;
+    settings.spawnPoints = generateSpawnPoints(config.players, config.width, config.height);
+
+    static uint8_t received[1 << 16];
+    EpollTransport transport; // Outlives the room, which removes its sockets from it
+    Room room(1, settings);
+    room.attach(transport);
+    std::vector<int> serverEnds, clientEnds;
+    for (int i = 0; i < config.players; ++i) {
+        int ends[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, ends) != 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        serverEnds.push_back(ends[0]);
+        clientEnds.push_back(ends[1]);
+        // Characters must be unique in a match, there are not enough printable ones for 255 players
+        if (!room.addPlayer(ends[0], "player" + std::to_string(i), static_cast<char>(i + 1),
+                            i == 0 ? Protocol::Text : Protocol::Binary, true, received, 0)) {
+            fprintf(stderr, "Player %d could not join the room.\n", i);
+            exit(1);
+        }
+    }
+    room.start();
+    // The player lists sent on every join are still queued, with 255 players more than the socket
+    // buffers hold. Get them out of the way so they do not hold up the first turns.
+    do {
+        room.flushOutput();
+    } while (drainClients(clientEnds, received, sizeof(received)) > 0);
+
+    // Moves only, round in a square, so nobody is eliminated and every turn looks alike
+    const Opcode moves[] = {Opcode::Up, Opcode::Right, Opcode::Down, Opcode::Left};
+    uint32_t turn = 0;
+    auto playTurn = [&]() {
+        Opcode move = moves[turn % 4];
+        for (int id = 0; id < config.players; ++id) {
+            uint8_t input[32];
+            FrameWriter writer(input, sizeof(input));
+            if (id == 0) {
+                const char* text = opcodeToText(move);
+                writer.bytes(text, strlen(text)).u8('|');
+            } else {
+                writer.begin(MessageType::Command).u8(static_cast<uint8_t>(move)).end();
+                writer.begin(MessageType::Ack).u32(turn).end();
+            }
+            room.onEvent({TransportEvent::Type::Received, serverEnds[id], writer.data(), writer.length()});
+        }
+        room.processInputs(Clock::now());
+        room.flushOutput();
+        turn++;
+        drainClients(clientEnds, received, sizeof(received));
+    };
+    // The first turns send keyframes and grow the pools and buffers to what a turn needs
+    for (int i = 0; i < kWarmupTurns; ++i) {
+        playTurn();
+    }
+    double allocated = benchmark("turn (steady state)", config, [&](size_t) {
+        playTurn();
+    });
+    for (int socket : clientEnds) {
+        close(socket);
+    }
+    return allocated;
+}
+
+void benchClient(const BenchConfig& config) {
+    GameState game = makeGame(config);
+    std::string positions = generatePositions(game);
+    std::string moveStatus = "MoveStatus:" + generateMoveStatus(game);
+
+    PlayerPositions playerPositions;
+    benchmark("parsePlayerPositions", config, [&](size_t) {
+        parsePlayerPositions(positions, playerPositions);
+        keep(playerPositions.size());
+    });
+
+    MoveStatusList playerMoveStatus;
+    benchmark("parseMoveStatus", config, [&](size_t) {
+        parseMoveStatus(moveStatus, playerMoveStatus);
+        keep(playerMoveStatus.size());
+    });
+
+    // Everything a text client receives in one turn: every player's move, then the reset and positions
+    std::string turn;
+    for (int id = 0; id < game.playerCount(); ++id) {
+        turn += "L" + std::string(1, game.character[id]) + "|";
+    }
+    turn += "R|P" + positions + "|";
+    ReceiveBuffer inbox(64 * 1024);
+    benchmark("splitCommands (turn)", config, [&](size_t) {
+        inbox.append(reinterpret_cast<const uint8_t*>(turn.data()), turn.size());
+        std::string_view message;
+        size_t count = 0;
+        while (inbox.nextDelimited('|', message)) {
+            count += message.size();
+            inbox.consume(message.size() + 1);
+        }
+        keep(count);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    bool allocated = false;
+    for (const auto& config : kConfigs) {
+        benchServer(config);
+        allocated |= benchRoom(config) > 0;
+        benchClient(config);
+    }
+    if (allocated) {
+        fprintf(stderr, "A turn of a running match allocated.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,451 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/epoll.h>
+#include "client_network.h"
+
+// Headless load generator. Opens many binary protocol connections, plays every match they end up in
+// with a random or scripted policy and reports turn throughput, turn latency and errors. Spectators
+// watch the newest match instead and count the states they get.
+
+using Clock = std::chrono::steady_clock;
+
+struct BotOptions {
+    std::string host = "127.0.0.1";
+    int port = 0;
+    int clients = 4;
+    int threads = 1;
+    double rate = 0;              // Max commands per second per bot, 0 sends as soon as a turn resolves
+    int duration = 10;            // Seconds
+    std::vector<Opcode> script;   // Empty for random play
+    bool datagrams = false;       // UDP mode, see datagram.h
+    int spectators = 0;           // Connections that watch instead of playing
+};
+
+// Counters shared by all bot threads, latency samples are swapped out by the reporter
+struct BotStats {
+    std::atomic<uint64_t> commands{0};
+    std::atomic<uint64_t> stateUpdates{0};
+    std::atomic<uint64_t> stateBytes{0};    // Size of those updates, frame headers included
+    std::atomic<uint64_t> turnsTimesThousand{0}; // Each update counts as 1/alive players of a turn
+    std::atomic<uint64_t> matchesWon{0};
+    std::atomic<uint64_t> eliminations{0};
+    std::atomic<uint64_t> connectErrors{0};
+    std::atomic<uint64_t> disconnects{0};   // Server closed a connection in the middle of a match
+    std::atomic<uint64_t> protocolErrors{0};
+    std::atomic<uint64_t> taken{0};         // Name or character clashed, the bot retried
+    std::atomic<int> playing{0};
+    std::atomic<int> watching{0};
+    std::atomic<uint64_t> snapshots{0};     // States received by spectators
+    std::mutex latencyMutex;
+    std::vector<uint32_t> latencies;        // Command to resolved turn, in microseconds
+};
+
+struct Bot {
+    enum class State { Lobby, Playing, Watching };
+
+    int index;
+    bool spectator;
+    int session = 0; // Bumped on every reconnect so names and characters stay unique
+    std::unique_ptr<ClientNetwork> network;
+    State state = State::Lobby;
+    int playerId = -1;
+    int alive = 0;
+    bool waitingForTurn = false;
+    uint32_t newestTurn = 0;      // States up to this one were counted, resends and late ones are not
+    bool datagramWatched = false; // The UDP socket is in the epoll set
+    Clock::time_point sentAt;
+    Clock::time_point nextCommandAt;
+    size_t scriptPosition = 0;
+    std::mt19937 rng;
+
+    Bot(int index, bool spectator) : index(index), spectator(spectator), rng(index) {}
+};
+
+class BotRunner {
+private:
+    const BotOptions& options;
+    BotStats& stats;
+    std::vector<std::unique_ptr<Bot>> bots;
+    int epoll_fd;
+    std::vector<uint32_t> latencies; // Flushed into stats every so often to keep the lock off the loop
+
+    std::string nameFor(const Bot& bot) const {
+        return "bot" + std::to_string(bot.index) + "-" + std::to_string(bot.session);
+    }
+
+    // Printable characters, consecutive bots join the same room so they rarely clash
+    char characterFor(const Bot& bot) const {
+        return 33 + (bot.index + bot.session * 7) % 94;
+    }
+
+    void connectBot(Bot& bot) {
+        if (bot.network) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot.network->getSocket(), nullptr);
+            if (bot.datagramWatched) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot.network->getDatagramSocket(), nullptr);
+            }
+        }
+        if (bot.state == Bot::State::Playing) {
+            stats.playing--;
+        } else if (bot.state == Bot::State::Watching) {
+            stats.watching--;
+        }
+        bot.network = std::make_unique<ClientNetwork>();
+        bot.state = Bot::State::Lobby;
+        bot.playerId = -1;
+        bot.waitingForTurn = false;
+        bot.newestTurn = 0;
+        bot.datagramWatched = false;
+        bot.session++;
+
+        if (!bot.network->connectToServer(options.host, options.port)) {
+            stats.connectErrors++;
+            bot.network.reset();
+            return;
+        }
+
+        std::string name = nameFor(bot);
+        uint8_t buffer[sizeof(kBinaryPreamble) + kFrameHeaderSize + 2 + 255];
+        FrameWriter hello(buffer, sizeof(buffer));
+        hello.bytes(kBinaryPreamble, sizeof(kBinaryPreamble));
+        if (bot.spectator) {
+            hello.begin(MessageType::Watch).u32(0).end();
+        } else {
+            hello.begin(MessageType::Hello).u8(characterFor(bot)).u8(name.size()).bytes(name.data(), name.size()).end();
+        }
+        bot.network->sendFrame(hello);
+        if (options.datagrams && !bot.spectator) {
+            bot.network->requestDatagrams();
+        }
+        bot.network->setNonBlocking(true);
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = &bot;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot.network->getSocket(), &ev);
+    }
+
+    Opcode nextOpcode(Bot& bot) {
+        if (!options.script.empty()) {
+            return options.script[bot.scriptPosition++ % options.script.size()];
+        }
+        std::uniform_int_distribution<int> pick(static_cast<int>(Opcode::Up), static_cast<int>(Opcode::AttackBottomRight));
+        return static_cast<Opcode>(pick(bot.rng));
+    }
+
+    void sendCommand(Bot& bot, Clock::time_point now) {
+        bot.network->sendCommand(static_cast<uint8_t>(nextOpcode(bot)));
+        bot.waitingForTurn = true;
+        bot.sentAt = now;
+        stats.commands++;
+    }
+
+    void sendShutdown(Bot& bot) {
+        uint8_t buffer[kFrameHeaderSize];
+        FrameWriter frame(buffer, sizeof(buffer));
+        frame.begin(MessageType::Shutdown).end();
+        bot.network->sendFrame(frame);
+    }
+
+    // Spectators are sent the players once, then states
+    void handleSpectatorFrame(Bot& bot, const Frame& frame) {
+        if (frame.type == MessageType::PlayerList && bot.state == Bot::State::Lobby) {
+            bot.state = Bot::State::Watching;
+            stats.watching++;
+        } else if (frame.type == MessageType::Positions) {
+            stats.snapshots++;
+        }
+    }
+
+    // Returns false once the bot is done with its connection and should reconnect
+    bool handleFrame(Bot& bot, const Frame& frame, Clock::time_point now) {
+        if (bot.spectator) {
+            handleSpectatorFrame(bot, frame);
+            return true; // Until the match is over and the server closes the connection
+        }
+        PayloadReader reader(frame);
+        switch (frame.type) {
+            case MessageType::Taken:
+                stats.taken++;
+                return false;
+            case MessageType::PlayerList: {
+                int slots = reader.u8();
+                reader.u16();
+                reader.u16();
+                int count = reader.u8();
+                std::string name = nameFor(bot);
+                for (int i = 0; i < count; ++i) {
+                    uint8_t id = reader.u8();
+                    reader.u16(); // Character and color
+                    uint8_t nameLength = reader.u8();
+                    const uint8_t* playerName = reader.bytes(nameLength);
+                    if (playerName && name.compare(0, std::string::npos, reinterpret_cast<const char*>(playerName), nameLength) == 0) {
+                        bot.playerId = id;
+                    }
+                }
+                if (!reader.good()) {
+                    stats.protocolErrors++;
+                    return false;
+                }
+                if (count == slots && bot.state == Bot::State::Lobby) {
+                    bot.state = Bot::State::Playing;
+                    bot.alive = count;
+                    bot.nextCommandAt = now;
+                    stats.playing++;
+                }
+                return true;
+            }
+            case MessageType::Positions:
+            case MessageType::Delta: {
+                uint32_t turn = reader.u32();
+                if (turn <= bot.newestTurn) {
+                    bot.network->sendAck(bot.newestTurn); // Resent over UDP, or overtaken by a newer one
+                    return true;
+                }
+                bot.newestTurn = turn;
+                stats.stateUpdates++;
+                stats.stateBytes += frame.totalSize;
+                stats.turnsTimesThousand += 1000 / std::max(bot.alive, 1);
+                if (bot.waitingForTurn) {
+                    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - bot.sentAt);
+                    latencies.push_back(latency.count());
+                    bot.waitingForTurn = false;
+                    bot.nextCommandAt = options.rate > 0
+                            ? bot.sentAt + std::chrono::microseconds(static_cast<int64_t>(1e6 / options.rate))
+                            : now;
+                }
+                bot.network->sendAck(turn);
+                return true;
+            }
+            case MessageType::Eliminated: {
+                uint8_t id = reader.u8();
+                bot.alive--;
+                if (id == bot.playerId) {
+                    stats.eliminations++;
+                    return false; // Make room for the others and join a new match
+                }
+                if (bot.alive <= 1) {
+                    sendShutdown(bot); // Last one standing ends the match
+                    stats.matchesWon++;
+                    return false;
+                }
+                return true;
+            }
+            default:
+                return true;
+        }
+    }
+
+    // Also called when a UDP resend is due, receive() takes care of it
+    void onReadable(Bot& bot, Clock::time_point now) {
+        ClientNetwork& network = *bot.network;
+        bool connected = network.receive();
+        for (ReceiveBuffer* frames : {&network.buffer(), &network.datagramBuffer()}) {
+            Frame frame;
+            while (frames->nextFrame(frame)) {
+                bool keep = network.handleNetworkFrame(frame) || handleFrame(bot, frame, now);
+                frames->consume(frame.totalSize);
+                if (!keep) {
+                    connectBot(bot);
+                    return;
+                }
+            }
+        }
+        if (network.getDatagramSocket() >= 0 && !bot.datagramWatched) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = &bot;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, network.getDatagramSocket(), &ev);
+            bot.datagramWatched = true;
+        }
+        if (!connected) {
+            if (bot.state == Bot::State::Playing) {
+                stats.disconnects++;
+            }
+            connectBot(bot);
+        }
+    }
+
+    void flushLatencies() {
+        std::lock_guard<std::mutex> guard(stats.latencyMutex);
+        stats.latencies.insert(stats.latencies.end(), latencies.begin(), latencies.end());
+        latencies.clear();
+    }
+
+public:
+    BotRunner(const BotOptions& options, BotStats& stats, int firstIndex, int count) : options(options), stats(stats) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (int i = 0; i < count; ++i) {
+            bots.push_back(std::make_unique<Bot>(firstIndex + i, firstIndex + i >= options.clients));
+        }
+    }
+
+    void run(Clock::time_point end) {
+        for (auto& bot : bots) {
+            connectBot(*bot);
+        }
+
+        std::vector<struct epoll_event> events(256);
+        auto nextFlush = Clock::now();
+        int timeoutMs = 0;
+        while (Clock::now() < end) {
+            int ready = epoll_wait(epoll_fd, events.data(), events.size(), timeoutMs);
+            auto now = Clock::now();
+            for (int i = 0; i < ready; ++i) {
+                onReadable(*static_cast<Bot*>(events[i].data.ptr), now);
+            }
+
+            timeoutMs = options.rate > 0 ? 1 : 50;
+            for (auto& bot : bots) {
+                if (!bot->network) {
+                    connectBot(*bot); // Connecting failed earlier, try again
+                    continue;
+                }
+                if (bot->network->retransmitTimeoutMs() == 0) {
+                    onReadable(*bot, now);
+                    if (!bot->network) continue;
+                }
+                if (bot->state == Bot::State::Playing && !bot->waitingForTurn && now >= bot->nextCommandAt) {
+                    sendCommand(*bot, now);
+                }
+                int retransmitMs = bot->network->retransmitTimeoutMs();
+                if (retransmitMs >= 0) timeoutMs = std::min(timeoutMs, std::max(retransmitMs, 1));
+            }
+
+            if (now >= nextFlush) {
+                flushLatencies();
+                nextFlush = now + std::chrono::milliseconds(100);
+            }
+        }
+        flushLatencies();
+    }
+
+    ~BotRunner() {
+        bots.clear();
+        close(epoll_fd);
+    }
+};
+
+uint32_t percentile(std::vector<uint32_t>& sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+void report(const char* label, double seconds, uint64_t turnsTimesThousand, uint64_t commands,
+            std::vector<uint32_t>& latencies, const BotStats& stats) {
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s %6.1fs  turns/s %8.1f  commands/s %8.1f  rtt us p50 %6u p90 %6u p99 %6u max %6u  "
+           "playing %d  errors connect %lu disconnect %lu protocol %lu\n",
+           label, seconds, turnsTimesThousand / 1000.0 / seconds, commands / seconds,
+           percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+           latencies.empty() ? 0 : latencies.back(), stats.playing.load(),
+           stats.connectErrors.load(), stats.disconnects.load(), stats.protocolErrors.load());
+    fflush(stdout);
+}
+
+bool parseScript(const std::string& text, std::vector<Opcode>& script) {
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) end = text.size();
+        Opcode opcode = opcodeFromText(text.data() + start, end - start);
+        if (opcode == Opcode::None) return false;
+        script.push_back(opcode);
+        start = end + 1;
+    }
+    return !script.empty();
+}
+
+int main(int argc, char* argv[]) {
+    BotOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--udp") {
+            options.datagrams = true;
+            continue;
+        }
+        if (i + 1 == argc) break;
+        std::string value = argv[++i];
+        if (option == "--host") options.host = value;
+        else if (option == "--port") options.port = std::atoi(value.c_str());
+        else if (option == "--clients") options.clients = std::atoi(value.c_str());
+        else if (option == "--spectators") options.spectators = std::atoi(value.c_str());
+        else if (option == "--threads") options.threads = std::atoi(value.c_str());
+        else if (option == "--rate") options.rate = std::atof(value.c_str());
+        else if (option == "--duration") options.duration = std::atoi(value.c_str());
+        else if (option == "--script" && !parseScript(value, options.script)) {
+            std::cerr << "Unknown command in script: " << value << std::endl;
+            return 1;
+        }
+    }
+    if (options.port <= 0 || options.clients <= 0 || options.spectators < 0 || options.threads <= 0 ||
+        options.duration <= 0) {
+        std::cerr << "Usage: " << argv[0] << " --port PORT [--host 127.0.0.1] [--clients 4] [--threads 1]"
+                  << " [--rate COMMANDS_PER_SECOND] [--duration 10] [--script UP,RIGHT,H,...] [--udp]"
+                  << " [--spectators 0]" << std::endl;
+        return 1;
+    }
+    // Spectators come after the players and are spread over the threads with them
+    int connections = options.clients + options.spectators;
+    options.threads = std::min(options.threads, connections);
+
+    BotStats stats;
+    auto start = Clock::now();
+    auto end = start + std::chrono::seconds(options.duration);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; ++t) {
+        int first = connections * t / options.threads;
+        int last = connections * (t + 1) / options.threads;
+        threads.emplace_back([&, first, last] {
+            BotRunner runner(options, stats, first, last - first);
+            runner.run(end);
+        });
+    }
+
+    // Report once per second, then a summary over the whole run
+    std::vector<uint32_t> all;
+    uint64_t lastTurns = 0, lastCommands = 0;
+    for (int second = 1; second <= options.duration; ++second) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(second));
+        std::vector<uint32_t> interval;
+        {
+            std::lock_guard<std::mutex> guard(stats.latencyMutex);
+            interval.swap(stats.latencies);
+        }
+        all.insert(all.end(), interval.begin(), interval.end());
+        uint64_t turns = stats.turnsTimesThousand.load(), commands = stats.commands.load();
+        report("[bot]", 1.0, turns - lastTurns, commands - lastCommands, interval, stats);
+        lastTurns = turns;
+        lastCommands = commands;
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> guard(stats.latencyMutex);
+        all.insert(all.end(), stats.latencies.begin(), stats.latencies.end());
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    report("[total]", elapsed, stats.turnsTimesThousand.load(), stats.commands.load(), all, stats);
+    printf("matches won %lu, eliminations %lu, name clashes retried %lu\n",
+           stats.matchesWon.load(), stats.eliminations.load(), stats.taken.load());
+    printf("states received %lu, %.1f bytes each\n", stats.stateUpdates.load(),
+           static_cast<double>(stats.stateBytes.load()) / std::max<uint64_t>(stats.stateUpdates.load(), 1));
+    if (options.spectators > 0) {
+        printf("spectators watching %d, states received %lu (%.0f/s)\n", stats.watching.load(),
+               stats.snapshots.load(), stats.snapshots.load() / elapsed);
+    }
+    return 0;
+}
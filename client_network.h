@@ -0,0 +1,320 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
+#include "receive_buffer.h"
+#include "datagram.h"
+
+// Client side of the connection, shared by the game client and the bot
+class ClientNetwork {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    int sock;
+    struct sockaddr_in serv_addr;
+    bool nonBlocking = false;
+    ReceiveBuffer inbox; // Reassembles server messages across reads
+
+    // UDP mode, see datagram.h
+    int datagramSock = -1;
+    uint32_t datagramRoom = 0;
+    uint32_t datagramSecret = 0;
+    bool datagramBound = false;         // The server answered over UDP, commands and acks go that way
+    std::chrono::milliseconds bindInterval{100}; // Doubles with every unanswered bind, up to a second
+    uint8_t pendingInputs[kMaxPendingInputs];    // Commands the server has not acknowledged, oldest first
+    uint32_t firstPendingInput = 1;     // Sequence number of pendingInputs[0]
+    int pendingInputCount = 0;
+    int inputResends = 0;
+    Clock::time_point inputsSentAt;
+    Clock::time_point nextDatagramAt;   // When the unanswered bind or the unacknowledged commands go again
+    RttEstimator rtt;
+    ReceiveBuffer datagramInbox;        // Game frames that came over UDP, whole frames only
+
+    // Sends frame, followed by the unacknowledged commands if there are any, in one datagram
+    void sendDatagram(const FrameWriter* frame) {
+        uint8_t buffer[64];
+        FrameWriter datagram(buffer, sizeof(buffer));
+        if (frame) {
+            datagram.bytes(frame->data(), frame->length());
+        }
+        if (pendingInputCount > 0) {
+            datagram.begin(MessageType::Inputs).u32(firstPendingInput).u8(pendingInputCount)
+                    .bytes(pendingInputs, pendingInputCount).end();
+        }
+        if (datagram.ok() && datagram.length() > 0) {
+            send(datagramSock, datagram.data(), datagram.length(), MSG_DONTWAIT);
+        }
+    }
+
+    void sendBind() {
+        uint8_t buffer[kFrameHeaderSize + 8];
+        FrameWriter frame(buffer, sizeof(buffer));
+        frame.begin(MessageType::DatagramBind).u32(datagramRoom).u32(datagramSecret).end();
+        send(datagramSock, frame.data(), frame.length(), MSG_DONTWAIT);
+    }
+
+    // Over UDP once bound, TCP until then
+    void sendControl(const FrameWriter& frame) {
+        if (datagramBound) {
+            sendDatagram(&frame);
+        } else {
+            sendFrame(frame);
+        }
+    }
+
+    void acknowledgeInputs(uint32_t next) {
+        int32_t acked = static_cast<int32_t>(next - firstPendingInput);
+        if (acked <= 0) return;
+        acked = std::min(acked, static_cast<int32_t>(pendingInputCount));
+        if (inputResends == 0) {
+            rtt.sample(Clock::now() - inputsSentAt);
+        }
+        pendingInputCount -= acked;
+        std::memmove(pendingInputs, pendingInputs + acked, pendingInputCount);
+        firstPendingInput += acked;
+        inputResends = 0;
+        inputsSentAt = Clock::now();
+        nextDatagramAt = inputsSentAt + rtt.resendTimeout();
+    }
+
+    // Datagrams hold whole frames. Those for the connection are handled here, the rest wait in the
+    // datagram buffer. Any datagram from the server shows UDP works both ways.
+    void readDatagrams() {
+        uint8_t buffer[kDatagramBufferSize];
+        while (true) {
+            ssize_t size = recv(datagramSock, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (size < 0 && (errno == EINTR || errno == ECONNREFUSED)) continue;
+            if (size < 0) return;
+            datagramBound = true;
+            Frame frame;
+            size_t offset = 0;
+            while (peekFrame(buffer + offset, size - offset, frame)) {
+                if (!handleNetworkFrame(frame)) {
+                    datagramInbox.append(buffer + offset, frame.totalSize);
+                }
+                offset += frame.totalSize;
+            }
+        }
+    }
+
+    // Resends the bind or the unacknowledged commands once their timeout passed. Commands that went
+    // unacknowledged kMaxDatagramResends times also go over TCP, the server drops the copies it has.
+    void resendDue(Clock::time_point now) {
+        if (datagramSock < 0 || now < nextDatagramAt) return;
+        if (!datagramBound) {
+            sendBind();
+            nextDatagramAt = now + bindInterval;
+            bindInterval = std::min(bindInterval * 2, std::chrono::milliseconds(1000));
+            return;
+        }
+        if (pendingInputCount == 0) return;
+        if (++inputResends > kMaxDatagramResends) {
+            uint8_t buffer[32];
+            FrameWriter frame(buffer, sizeof(buffer));
+            frame.begin(MessageType::Inputs).u32(firstPendingInput).u8(pendingInputCount)
+                 .bytes(pendingInputs, pendingInputCount).end();
+            sendFrame(frame);
+        }
+        sendDatagram(nullptr);
+        nextDatagramAt = now + rtt.resendTimeout(inputResends);
+    }
+
+public:
+    ClientNetwork() : sock(-1) {
+        serv_addr.sin_family = AF_INET;
+    }
+
+    bool connectToServer(const std::string& address, int port) {
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            return false;
+        }
+        serv_addr.sin_port = htons(port);
+
+        if (inet_pton(AF_INET, address.c_str(), &serv_addr.sin_addr) <= 0) {
+            return false;
+        }
+
+        if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+            return false;
+        }
+
+        // Commands are a few bytes each, send them right away instead of waiting to coalesce
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        return true;
+    }
+
+    void sendData(const std::string& data) {
+        send(sock, data.c_str(), data.size(), MSG_NOSIGNAL);
+    }
+
+    void sendFrame(const FrameWriter& frame) {
+        send(sock, frame.data(), frame.length(), MSG_NOSIGNAL);
+    }
+
+    // Reads what the server sent into the receive buffer, waiting for data unless the socket is non-blocking.
+    // In UDP mode also reads the datagrams that came in and resends what is overdue. Returns false once
+    // the server closed the connection.
+    bool receive() {
+        bool open = inbox.readFrom(sock, !nonBlocking) != ReceiveBuffer::ReadStatus::Closed;
+        retransmit();
+        return open;
+    }
+
+    // Sleeps until the server sent something, wakeFd became readable or something is due to be resent.
+    // Returns false for wakeFd.
+    bool waitForData(int wakeFd) {
+        struct pollfd fds[3] = {{sock, POLLIN, 0}, {wakeFd, POLLIN, 0}, {datagramSock, POLLIN, 0}};
+        while (poll(fds, datagramSock >= 0 ? 3 : 2, retransmitTimeoutMs()) < 0) {
+            if (errno != EINTR) return false;
+        }
+        return !(fds[1].revents & POLLIN);
+    }
+
+    ReceiveBuffer& buffer() {
+        return inbox;
+    }
+
+    // Game frames that came over UDP, see datagram.h. Never holds a partial frame.
+    ReceiveBuffer& datagramBuffer() {
+        return datagramInbox;
+    }
+
+    // Asks the server for UDP mode, right after the handshake. Nothing changes until the server
+    // answers with a DatagramOffer, which handleNetworkFrame() takes.
+    void requestDatagrams() {
+        uint8_t buffer[kFrameHeaderSize];
+        FrameWriter frame(buffer, sizeof(buffer));
+        frame.begin(MessageType::DatagramOpen).end();
+        sendFrame(frame);
+    }
+
+    // Takes the frames that are about the connection rather than the game, from the TCP stream or a
+    // datagram. Returns false for the others.
+    bool handleNetworkFrame(const Frame& frame) {
+        PayloadReader reader(frame);
+        switch (frame.type) {
+            case MessageType::DatagramOffer: {
+                uint32_t room = reader.u32();
+                uint32_t secret = reader.u32();
+                if (!reader.good() || datagramSock >= 0) return true;
+                datagramSock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (datagramSock >= 0 && connect(datagramSock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+                    close(datagramSock);
+                    datagramSock = -1;
+                }
+                if (datagramSock < 0) return true; // Stays on TCP
+                datagramRoom = room;
+                datagramSecret = secret;
+                nextDatagramAt = Clock::now();
+                resendDue(nextDatagramAt);
+                return true;
+            }
+            case MessageType::DatagramBind:
+                return true; // The server answered, any datagram tells us that
+            case MessageType::InputAck: {
+                uint32_t next = reader.u32();
+                if (reader.good()) acknowledgeInputs(next);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    // Commands go over TCP until UDP is bound. Over UDP each is numbered and repeated in every datagram
+    // until the server acknowledges it.
+    void sendCommand(uint8_t opcode) {
+        if (!datagramBound) {
+            uint8_t buffer[kFrameHeaderSize + 1];
+            FrameWriter frame(buffer, sizeof(buffer));
+            frame.begin(MessageType::Command).u8(opcode).end();
+            sendFrame(frame);
+            return;
+        }
+        if (pendingInputCount == kMaxPendingInputs) {
+            std::memmove(pendingInputs, pendingInputs + 1, --pendingInputCount); // Given up, the server skips it
+            firstPendingInput++;
+        }
+        pendingInputs[pendingInputCount++] = opcode;
+        inputResends = 0;
+        inputsSentAt = Clock::now();
+        nextDatagramAt = inputsSentAt + rtt.resendTimeout();
+        sendDatagram(nullptr);
+    }
+
+    // Acknowledges the newest state the client has, which may have come over either path
+    void sendAck(uint32_t turn) {
+        uint8_t buffer[kFrameHeaderSize + 4];
+        FrameWriter frame(buffer, sizeof(buffer));
+        frame.begin(MessageType::Ack).u32(turn).end();
+        sendControl(frame);
+    }
+
+    void sendKeyframeRequest() {
+        uint8_t buffer[kFrameHeaderSize];
+        FrameWriter frame(buffer, sizeof(buffer));
+        frame.begin(MessageType::KeyframeRequest).end();
+        sendControl(frame);
+    }
+
+    // Reads the datagrams that came in and resends whatever waited too long for the server. receive() does
+    // this too, call it when the timeout from retransmitTimeoutMs() passed without anything to read.
+    void retransmit() {
+        if (datagramSock < 0) return;
+        readDatagrams();
+        resendDue(Clock::now());
+    }
+
+    // How long the caller may wait before calling retransmit(), -1 for as long as it likes
+    int retransmitTimeoutMs() const {
+        if (datagramSock < 0 || (datagramBound && pendingInputCount == 0)) return -1;
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(nextDatagramAt - Clock::now()).count();
+        return left > 0 ? static_cast<int>((left + 999) / 1000) : 0;
+    }
+
+    // -1 until the server offered UDP mode
+    int getDatagramSocket() const {
+        return datagramSock;
+    }
+
+    void setNonBlocking(bool nonBlocking) {
+        this->nonBlocking = nonBlocking;
+        int flags = fcntl(sock, F_GETFL, 0);
+        if (nonBlocking) {
+            fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+        } else {
+            fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+
+    int getSocket() const {
+        return sock;
+    }
+
+    void disconnect() {
+        if (sock != -1) {
+            close(sock);
+            sock = -1;
+        }
+        if (datagramSock != -1) {
+            close(datagramSock);
+            datagramSock = -1;
+        }
+    }
+
+    ~ClientNetwork() {
+        disconnect();
+    }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "logger.h"
+
+// Parsers for the text protocol messages the client draws from, kept apart from the ncurses code.
+// They make one pass over the message and write into tables that keep their capacity between
+// messages, so once a match is running parsing a message does not allocate.
+
+// Player character and its x, y and color pair, in the order the server sent them
+using PlayerPositions = std::vector<std::pair<char, std::tuple<int, int, int>>>;
+// Username, character, has moved, is eliminated
+using MoveStatusList = std::vector<std::tuple<std::string, char, bool, bool>>;
+
+// Takes the text up to the next delimiter (or the end) off the front of text
+inline std::string_view nextField(std::string_view& text, char delimiter) {
+    size_t end = text.find(delimiter);
+    std::string_view field = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return field;
+}
+
+// False unless the whole field is a decimal number
+inline bool parseNumber(std::string_view field, int& value) {
+    auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), value);
+    return error == std::errc() && end == field.data() + field.size() && !field.empty();
+}
+
+inline void removePlayer(PlayerPositions& playerPositions, char playerChar) {
+    playerPositions.erase(std::remove_if(playerPositions.begin(), playerPositions.end(),
+                                         [playerChar](const auto& entry) { return entry.first == playerChar; }),
+                          playerPositions.end());
+}
+
+// 'P' message body, "x,y,character,color;" per player. Eliminated players ("cX;") are skipped.
+inline void parsePlayerPositions(std::string_view positionsData, PlayerPositions& playerPositions) {
+    playerPositions.clear(); // Clear previous positions
+
+    while (!positionsData.empty()) {
+        std::string_view playerInfo = nextField(positionsData, ';');
+        if (playerInfo.empty()) continue;
+
+        std::string_view fields = playerInfo;
+        std::string_view xStr = nextField(fields, ',');
+        std::string_view yStr = nextField(fields, ',');
+        std::string_view charStr = nextField(fields, ',');
+        std::string_view colorPairStr = nextField(fields, ',');
+
+        int x, y, colorPair;
+        if (colorPairStr.empty()) {
+            LOG_WARNING("Invalid or missing color pair: ", playerInfo);
+            continue; // Skip this player info if the color pair is missing or invalid
+        }
+        if (!parseNumber(xStr, x) || !parseNumber(yStr, y) || !parseNumber(colorPairStr, colorPair)) {
+            LOG_WARNING("Invalid data received for player position: ", playerInfo);
+            continue;
+        }
+        char playerChar = !charStr.empty() ? charStr.front() : ' ';
+        playerPositions.emplace_back(playerChar, std::make_tuple(x, y, colorPair));
+    }
+}
+
+// Overwrites entry index of the list, or appends it, reusing the username's storage
+inline void setMoveStatus(MoveStatusList& playerMoveStatus, size_t index, std::string_view username, char character,
+                          bool hasMoved) {
+    if (index == playerMoveStatus.size()) {
+        playerMoveStatus.emplace_back(std::string(username), character, hasMoved, false);
+        return;
+    }
+    auto& [name, charInList, moved, isEliminated] = playerMoveStatus[index];
+    name.assign(username.data(), username.size());
+    charInList = character;
+    moved = hasMoved;
+    isEliminated = false;
+}
+
+// "MoveStatus:" message, "username,character,moved;" per player
+inline void parseMoveStatus(std::string_view moveStatus, MoveStatusList& playerMoveStatus) {
+    moveStatus.remove_prefix(std::min<size_t>(11, moveStatus.size())); // Skip "MoveStatus:" prefix
+    size_t count = 0;
+    while (!moveStatus.empty()) {
+        std::string_view playerInfo = nextField(moveStatus, ';');
+        if (playerInfo.empty()) continue;
+
+        std::string_view username = nextField(playerInfo, ',');
+        std::string_view charStr = nextField(playerInfo, ',');
+        std::string_view hasMovedStr = nextField(playerInfo, ',');
+        if (charStr.empty()) continue;
+
+        setMoveStatus(playerMoveStatus, count++, username, charStr[0], hasMovedStr == "1");
+    }
+    playerMoveStatus.resize(count);
+}
+
+// Player list from the lobby, "username, character;" per connected player. Empty slots have no comma.
+inline void parsePlayerList(std::string_view playerList, MoveStatusList& playerMoveStatus) {
+    size_t count = 0;
+    while (!playerList.empty()) {
+        std::string_view playerInfo = nextField(playerList, ';');
+        size_t commaPos = playerInfo.find(',');
+        if (commaPos == std::string_view::npos || commaPos + 2 >= playerInfo.size()) continue;
+
+        setMoveStatus(playerMoveStatus, count++, playerInfo.substr(0, commaPos), playerInfo[commaPos + 2], false);
+    }
+    playerMoveStatus.resize(count);
+}
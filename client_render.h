@@ -0,0 +1,101 @@
+#pragma once
+
+#include <ncurses.h>
+#include <string>
+#include <vector>
+#include "client_parsing.h"
+
+// Retained-mode views over the ncurses screen. Each remembers what it last drew and only touches
+// the cells and rows that changed, so an update costs the same whatever the arena size. Static
+// parts of the screen are drawn once by the caller. None of them call refresh(), the caller
+// refreshes once per batch of updates.
+
+// Players on the arena. Only tiles that held or hold a player are touched, the rest of the arena
+// is never looked at again. Tiles that still hold a player are written anyway: ncurses compares
+// against the terminal on refresh(), so this costs nothing on the wire and a player stays visible
+// even if other text was drawn over its tile.
+class ArenaView {
+private:
+    int originX = 0, originY = 0; // Screen position of arena tile (1, 1)
+    int width = 0, height = 0;
+    std::vector<chtype> tiles;    // ' ' or the player on each tile, only kept up to date where occupied
+    std::vector<int> occupied;    // Tiles holding a player
+    std::vector<int> next;
+
+    int indexOf(int x, int y) const {
+        return (x >= 1 && x <= width && y >= 1 && y <= height) ? (y - 1) * width + (x - 1) : -1;
+    }
+
+    void drawTile(int index) {
+        mvaddch(originY + index / width, originX + index % width, tiles[index]);
+    }
+
+public:
+    // Call after the arena border was drawn, the inside counts as empty
+    void reset(int screenX, int screenY, int arenaWidth, int arenaHeight) {
+        originX = screenX;
+        originY = screenY;
+        width = arenaWidth;
+        height = arenaHeight;
+        tiles.assign(width * height, ' ');
+        occupied.clear();
+    }
+
+    void drawPlayers(const PlayerPositions& players) {
+        for (int index : occupied) {
+            tiles[index] = ' ';
+        }
+        next.clear();
+        for (const auto& [playerChar, position] : players) {
+            auto [x, y, colorPair] = position;
+            int index = indexOf(x, y);
+            if (index < 0) continue;
+            tiles[index] = static_cast<unsigned char>(playerChar) | COLOR_PAIR(colorPair);
+            next.push_back(index);
+        }
+
+        // Blank the tiles players left, then draw every player
+        for (int index : occupied) {
+            if (tiles[index] == ' ') drawTile(index);
+        }
+        for (int index : next) {
+            drawTile(index);
+        }
+        occupied.swap(next);
+    }
+};
+
+// Lines of text at fixed rows, e.g. the player move list
+class TextRows {
+private:
+    struct Row {
+        std::string text;
+        int colorPair = -1;
+    };
+
+    int firstLine = 0;
+    std::vector<Row> rows;
+
+public:
+    // Call after the screen was cleared
+    void reset(int line) {
+        firstLine = line;
+        rows.clear();
+    }
+
+    void draw(size_t row, const std::string& text, int colorPair) {
+        if (row >= rows.size()) rows.resize(row + 1);
+        Row& shown = rows[row];
+        if (shown.text == text && shown.colorPair == colorPair) return;
+
+        attron(COLOR_PAIR(colorPair));
+        mvprintw(firstLine + row, 0, "%s", text.c_str());
+        attroff(COLOR_PAIR(colorPair));
+        // Blank out the rest of a longer previous text, without clearing whatever else is on the line
+        for (size_t column = text.size(); column < shown.text.size(); ++column) {
+            mvaddch(firstLine + row, column, ' ');
+        }
+        shown.text = text;
+        shown.colorPair = colorPair;
+    }
+};
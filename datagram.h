@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+// UDP mode. Over TCP one lost segment holds up everything sent after it until it is retransmitted,
+// 200 ms or more. A binary client that asks for UDP mode (DatagramOpen) keeps its TCP connection for
+// what has to arrive in order (lobby lists, the move list, eliminations, leaving) and also talks to
+// the server over UDP:
+//  - Commands are numbered and every datagram the client sends repeats all of them the server has
+//    not acknowledged (InputAck) yet. The client also resends them when no acknowledgement comes
+//    within a timeout, so a lost datagram usually costs nothing or one timeout.
+//  - The state after each turn is unreliable but newest wins. The server resends the latest one
+//    until the client acknowledges it (Ack) and replaces it as soon as there is a newer one. Clients
+//    drop anything older than what they already have.
+//
+// Datagrams hold whole frames in the same format as the TCP stream and go to the server's TCP port
+// number. The client binds its UDP socket with the secret it got in DatagramOffer. The server answers
+// every client that binds with a UDP socket of its own, connected to the client, which belongs to the
+// client's room from then on like its TCP socket. Until the client has been heard from over UDP, and
+// whenever a resend limit is reached, everything goes over TCP again.
+
+// Largest state the server sends in a datagram, bigger ones go over TCP. Stays below the usual path MTU.
+const size_t kMaxDatagramSize = 1200;
+// Receive buffers, enough for anything either side sends
+const size_t kDatagramBufferSize = 2048;
+// Unacknowledged commands a client keeps, the oldest is given up when more are sent
+const int kMaxPendingInputs = 8;
+// Resends without an acknowledgement after which the data also goes over TCP, in case UDP stopped getting through
+const int kMaxDatagramResends = 4;
+
+// Retransmission timeout from measured round trips, computed like TCP's (RFC 6298) with a 10 ms floor
+// instead of 200 ms. Only data sent once is sampled, a resend makes the round trip ambiguous.
+class RttEstimator {
+private:
+    static constexpr std::chrono::microseconds kInitial{100000};
+    static constexpr std::chrono::microseconds kMin{10000};
+    static constexpr std::chrono::microseconds kMax{1000000};
+
+    std::chrono::microseconds smoothed{0}; // Zero until the first sample
+    std::chrono::microseconds variation{0};
+
+public:
+    void sample(std::chrono::steady_clock::duration measured) {
+        auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(measured);
+        if (smoothed.count() == 0) {
+            smoothed = std::max(rtt, std::chrono::microseconds(1));
+            variation = rtt / 2;
+            return;
+        }
+        auto error = smoothed > rtt ? smoothed - rtt : rtt - smoothed;
+        variation = (3 * variation + error) / 4;
+        smoothed = (7 * smoothed + rtt) / 8;
+    }
+
+    // Doubles with every resend of the same data
+    std::chrono::microseconds resendTimeout(int resends = 0) const {
+        auto base = smoothed.count() == 0 ? kInitial : std::clamp(smoothed + 4 * variation, kMin, kMax);
+        return std::min(base * (1 << std::min(resends, 6)), kMax);
+    }
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// Dense grid over the arena, border included. Each cell holds the id of the player standing on it.
+class OccupancyGrid {
+private:
+    int width, height;
+    std::vector<int16_t> cells;
+
+public:
+    static constexpr int16_t kEmptyCell = -1;
+
+    OccupancyGrid(int width, int height) : width(width), height(height), cells(width * height, kEmptyCell) {}
+
+    bool contains(int x, int y) const {
+        return x >= 0 && x < width && y >= 0 && y < height;
+    }
+
+    int occupant(int x, int y) const {
+        return contains(x, y) ? cells[y * width + x] : kEmptyCell;
+    }
+
+    void set(int x, int y, int id) {
+        if (contains(x, y)) cells[y * width + x] = id;
+    }
+
+    void clear(int x, int y) {
+        set(x, y, kEmptyCell);
+    }
+
+    void reset() {
+        std::fill(cells.begin(), cells.end(), kEmptyCell);
+    }
+};
+
+// Per-player flags
+const uint8_t kPlayerMoved = 0x01;      // Sent a move for the current turn
+const uint8_t kPlayerEliminated = 0x02;
+
+// Everything turn resolution needs: the arena size, the players and who stands where.
+// Coordinates run from 1 to width/height with the border on the outermost tiles, as the client draws them.
+//
+// Players are stored as parallel arrays indexed by player id, so a turn walks a few small contiguous
+// arrays instead of chasing one heap object per player. Names are packed into a single buffer.
+class GameState {
+private:
+    std::string nameBuffer;
+    std::vector<uint32_t> nameOffset;
+    std::vector<uint16_t> nameLength;
+
+public:
+    int width, height;
+    std::vector<uint16_t> x, y;
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> colorPair;
+    std::vector<char> character;
+    OccupancyGrid grid;
+
+    GameState(int width, int height) : width(width), height(height), grid(width + 1, height + 1) {}
+
+    int playerCount() const {
+        return x.size();
+    }
+
+    std::string_view name(int id) const {
+        return std::string_view(nameBuffer).substr(nameOffset[id], nameLength[id]);
+    }
+
+    bool isEliminated(int id) const {
+        return flags[id] & kPlayerEliminated;
+    }
+
+    bool hasMoved(int id) const {
+        return flags[id] & kPlayerMoved;
+    }
+
+    bool isInsideArena(int x, int y) const {
+        return x > 1 && x < width && y > 1 && y < height;
+    }
+
+    // Returns the id of the new player
+    int addPlayer(std::string_view username, char playerChar, int spawnX, int spawnY, uint8_t color) {
+        int id = playerCount();
+        nameOffset.push_back(nameBuffer.size());
+        nameLength.push_back(std::min<size_t>(username.size(), 0xFFFF));
+        nameBuffer.append(username.substr(0, nameLength.back()));
+        x.push_back(spawnX);
+        y.push_back(spawnY);
+        flags.push_back(0);
+        colorPair.push_back(color);
+        character.push_back(playerChar);
+        grid.set(spawnX, spawnY, id);
+        return id;
+    }
+
+    // Only used before the match starts. Players after id move down by one, call rebuildGrid()
+    // once their positions have been reassigned.
+    void removePlayer(int id) {
+        std::string names;
+        for (int i = 0; i < playerCount(); ++i) {
+            if (i == id) continue;
+            std::string_view playerName = name(i);
+            nameOffset[i] = names.size();
+            names.append(playerName);
+        }
+        nameBuffer.swap(names);
+        nameOffset.erase(nameOffset.begin() + id);
+        nameLength.erase(nameLength.begin() + id);
+        x.erase(x.begin() + id);
+        y.erase(y.begin() + id);
+        flags.erase(flags.begin() + id);
+        colorPair.erase(colorPair.begin() + id);
+        character.erase(character.begin() + id);
+    }
+
+    void placePlayer(int id, int newX, int newY) {
+        if (grid.occupant(x[id], y[id]) == id) {
+            grid.clear(x[id], y[id]);
+        }
+        x[id] = newX;
+        y[id] = newY;
+        grid.set(newX, newY, id);
+    }
+
+    void eliminatePlayer(int id) {
+        flags[id] |= kPlayerEliminated;
+        if (grid.occupant(x[id], y[id]) == id) {
+            grid.clear(x[id], y[id]);
+        }
+    }
+
+    void clearMoves() {
+        for (auto& playerFlags : flags) {
+            playerFlags &= ~kPlayerMoved;
+        }
+    }
+
+    // Rebuilds the grid after ids or positions were rewritten wholesale
+    void rebuildGrid() {
+        grid.reset();
+        for (int id = 0; id < playerCount(); ++id) {
+            if (!isEliminated(id)) grid.set(x[id], y[id], id);
+        }
+    }
+};
+
+// Spawn points for count players: the four corners first, then each next point as far as possible
+// (in king moves) from the ones already taken. Server and client both derive the layout from this.
+inline std::vector<std::pair<int, int>> generateSpawnPoints(int count, int width, int height) {
+    std::vector<std::pair<int, int>> points = {{2, 2}, {width - 1, 2}, {2, height - 1}, {width - 1, height - 1}};
+    points.resize(std::min<size_t>(points.size(), count));
+
+    // Distance from every interior tile to the nearest spawn point so far
+    int innerWidth = width - 2, innerHeight = height - 2;
+    std::vector<int> distance(innerWidth * innerHeight, width + height);
+    auto claim = [&](const std::pair<int, int>& point) {
+        for (int cellY = 0; cellY < innerHeight; ++cellY) {
+            for (int cellX = 0; cellX < innerWidth; ++cellX) {
+                int d = std::max(std::abs(cellX + 2 - point.first), std::abs(cellY + 2 - point.second));
+                int& nearest = distance[cellY * innerWidth + cellX];
+                nearest = std::min(nearest, d);
+            }
+        }
+    };
+    for (const auto& point : points) {
+        claim(point);
+    }
+
+    while (static_cast<int>(points.size()) < count) {
+        auto farthest = std::max_element(distance.begin(), distance.end());
+        if (farthest == distance.end() || *farthest == 0) break; // Arena is full
+        int index = farthest - distance.begin();
+        points.push_back({index % innerWidth + 2, index / innerWidth + 2});
+        claim(points.back());
+    }
+    return points;
+}
+
+inline bool isPositionOccupied(int x, int y, const GameState& game) {
+    return game.grid.occupant(x, y) != OccupancyGrid::kEmptyCell;
+}
+
+inline void updatePlayerPosition(int id, std::string_view command, GameState& game) {
+    if (command.empty()) return;
+
+    char direction = command[0];
+
+    int newX = game.x[id], newY = game.y[id];
+
+    if (direction == 'U') newY -= 1;
+    else if (direction == 'D') newY += 1;
+    else if (direction == 'L') newX -= 1;
+    else if (direction == 'R') newX += 1;
+
+    // Boundary checks
+    if (game.isInsideArena(newX, newY) && !isPositionOccupied(newX, newY, game)) {
+        game.placePlayer(id, newX, newY);
+    }
+}
+
+inline bool isAttackCommand(std::string_view command) {
+    // Check if the command is one of the attack commands
+    static constexpr std::string_view attackCommands = "ETFYFHCGBCetfyfhcgbc";
+    return attackCommands.find(command) != std::string_view::npos;
+}
+
+// Returns the id of the eliminated player, or -1, so the caller can tell the clients about it
+inline int processAttackCommand(int attacker, GameState& game, std::string_view command) {
+    int attackX = game.x[attacker], attackY = game.y[attacker];
+
+    if (command == "e" || command == "E") { attackX--; attackY--; } // Attack top left
+    else if (command == "t" || command == "T") { attackY--; } // Attack top
+    else if (command == "y" || command == "Y") { attackX++; attackY--; } // Attack top right
+    else if (command == "f" || command == "F") { attackX--; } // Attack left
+    else if (command == "h" || command == "H") { attackX++; } // Attack right
+    else if (command == "c" || command == "C") { attackX--; attackY++; } // Attack bottom left
+    else if (command == "g" || command == "G") { attackY++; } // Attack bottom
+    else if (command == "b" || command == "B") { attackX++; attackY++; } // Attack bottom right
+
+    int target = game.grid.occupant(attackX, attackY);
+    if (target == OccupancyGrid::kEmptyCell || target == attacker) {
+        return -1;
+    }
+    game.eliminatePlayer(target); // Eliminate the target
+    return target;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "game.h"
+
+// Interest management for large arenas. With a view radius a binary client is only told about the
+// players within that many tiles of it (in king moves, so the view is a square around the player):
+// who moved, who came into view and who went out of it. Bandwidth per client then depends on how
+// crowded its surroundings are rather than on the size of the match.
+
+// Set of player ids, one bit per possible id
+class PlayerSet {
+private:
+    uint64_t words[4] = {};
+
+public:
+    void set(int id) {
+        words[id >> 6] |= uint64_t(1) << (id & 63);
+    }
+
+    bool test(int id) const {
+        return words[id >> 6] & (uint64_t(1) << (id & 63));
+    }
+
+    void clear() {
+        std::fill(std::begin(words), std::end(words), 0);
+    }
+
+    int size() const {
+        int count = 0;
+        for (uint64_t word : words) {
+            count += __builtin_popcountll(word);
+        }
+        return count;
+    }
+
+    // Calls fn(id) for every id in this set or in other, in ascending order
+    template <typename Fn>
+    void forEachIn(const PlayerSet& other, Fn fn) const {
+        for (int word = 0; word < 4; ++word) {
+            for (uint64_t bits = words[word] | other.words[word]; bits != 0; bits &= bits - 1) {
+                fn(word * 64 + __builtin_ctzll(bits));
+            }
+        }
+    }
+
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        forEachIn(*this, fn);
+    }
+};
+
+// Uniform grid over the arena, each cell as wide and high as the view radius, so everything in view
+// of a player lies in the 3x3 cells around it. Rebuilt from the player positions once per turn with
+// a counting sort, which allocates nothing once the grid has been sized.
+class InterestGrid {
+private:
+    int radius = 0;
+    int columns = 0, rows = 0;
+    std::vector<uint16_t> cellStart; // Where each cell's players start in members, one extra entry at the end
+    std::vector<uint8_t> members;    // Ids of the players still in the match, grouped by cell
+    std::vector<int> playerCell;
+
+    int cellOf(int x, int y) const {
+        return (y / radius) * columns + x / radius;
+    }
+
+public:
+    // Coordinates run from 0 to width/height, like the occupancy grid
+    void reset(int width, int height, int viewRadius, int players) {
+        radius = std::max(viewRadius, 1);
+        columns = width / radius + 1;
+        rows = height / radius + 1;
+        cellStart.assign(columns * rows + 1, 0);
+        members.resize(players);
+        playerCell.resize(players);
+    }
+
+    void rebuild(const GameState& game) {
+        std::fill(cellStart.begin(), cellStart.end(), 0);
+        for (int id = 0; id < game.playerCount(); ++id) {
+            playerCell[id] = game.isEliminated(id) ? -1 : cellOf(game.x[id], game.y[id]);
+            if (playerCell[id] >= 0) cellStart[playerCell[id] + 1]++;
+        }
+        for (size_t cell = 1; cell < cellStart.size(); ++cell) {
+            cellStart[cell] += cellStart[cell - 1];
+        }
+        // Filling a cell moves its start to the next cell's, shifting back by one restores them
+        for (int id = 0; id < game.playerCount(); ++id) {
+            if (playerCell[id] >= 0) members[cellStart[playerCell[id]]++] = id;
+        }
+        for (size_t cell = cellStart.size() - 1; cell > 0; --cell) {
+            cellStart[cell] = cellStart[cell - 1];
+        }
+        cellStart[0] = 0;
+    }
+
+    // The players still in the match within the view radius of (x, y), including one standing there
+    void query(const GameState& game, int x, int y, PlayerSet& visible) const {
+        visible.clear();
+        int cellX = x / radius, cellY = y / radius;
+        for (int row = std::max(cellY - 1, 0); row <= std::min(cellY + 1, rows - 1); ++row) {
+            for (int column = std::max(cellX - 1, 0); column <= std::min(cellX + 1, columns - 1); ++column) {
+                int cell = row * columns + column;
+                for (int i = cellStart[cell]; i < cellStart[cell + 1]; ++i) {
+                    int id = members[i];
+                    if (std::abs(game.x[id] - x) <= radius && std::abs(game.y[id] - y) <= radius) {
+                        visible.set(id);
+                    }
+                }
+            }
+        }
+    }
+};
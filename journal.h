@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "game.h"
+
+// Binary record of a match, enough to re-run it through the turn resolution code.
+//
+// The file starts with a header describing the match as it started
+//   "AGJ" u8 version | u32 room id | u64 start time (unix microseconds) | u16 width | u16 height | u8 count
+//   count x (u8 character | u8 color | u16 x | u16 y | u8 name length | name)
+// followed by fixed-size records in the order the server applied them
+//   u32 turn | u8 player id | u8 opcode | u16 milliseconds since the previous record (saturating)
+// Multi-byte fields are little endian, like the wire protocol.
+
+const uint8_t kJournalMagic[4] = {'A', 'G', 'J', 1};
+const size_t kJournalRecordSize = 8;
+
+// Player id of the record that closes a turn
+const uint8_t kJournalTurnEnd = 0xFF;
+
+// Opcodes besides the protocol's Opcode values. Opcode::None is a player who missed the turn deadline.
+const uint8_t kJournalDisconnect = 0xFE; // The player's connection dropped, it is eliminated
+const uint8_t kJournalShutdown = 0xFF;   // A client ended the match
+
+struct JournalRecord {
+    uint32_t turn;     // Turn the command belongs to, or the turn that was resolved
+    uint8_t playerId;
+    uint8_t opcode;
+    uint16_t deltaMs;
+};
+
+// Appends records to a buffer and only touches the file when it fills up, so journaling a
+// command costs a few stores on the turn path.
+class JournalWriter {
+private:
+    static const size_t kBufferSize = 64 * 1024;
+
+    int fd = -1;
+    uint8_t buffer[kBufferSize];
+    size_t size = 0;
+    std::chrono::steady_clock::time_point lastRecord;
+
+    void put(const void* data, size_t length) {
+        if (size + length > kBufferSize) flush();
+        std::memcpy(buffer + size, data, length);
+        size += length;
+    }
+
+    void u8(uint8_t value) {
+        put(&value, 1);
+    }
+
+    void u16(uint16_t value) {
+        uint8_t le[2] = {static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>(value >> 8)};
+        put(le, 2);
+    }
+
+    void u32(uint32_t value) {
+        u16(value & 0xFFFF);
+        u16(value >> 16);
+    }
+
+public:
+    JournalWriter() = default;
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    // Creates the file and writes the header, game holds the players at their spawn points
+    bool open(const std::string& path, uint32_t roomId, const GameState& game,
+              std::chrono::steady_clock::time_point now) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        uint64_t startTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        put(kJournalMagic, sizeof(kJournalMagic));
+        u32(roomId);
+        u32(startTime & 0xFFFFFFFF);
+        u32(startTime >> 32);
+        u16(game.width);
+        u16(game.height);
+        u8(game.playerCount());
+        for (int id = 0; id < game.playerCount(); ++id) {
+            std::string_view name = game.name(id).substr(0, 255);
+            u8(game.character[id]);
+            u8(game.colorPair[id]);
+            u16(game.x[id]);
+            u16(game.y[id]);
+            u8(name.size());
+            put(name.data(), name.size());
+        }
+        lastRecord = now;
+        return true;
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    void record(uint32_t turn, uint8_t playerId, uint8_t opcode, std::chrono::steady_clock::time_point now) {
+        auto delta = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastRecord).count();
+        if (delta < 0) {
+            delta = 0; // Stamped with an earlier wake time than the previous record
+        } else {
+            lastRecord = now;
+        }
+        u32(turn);
+        u8(playerId);
+        u8(opcode);
+        u16(delta > 0xFFFF ? 0xFFFF : delta);
+    }
+
+    void turnEnd(uint32_t turn, std::chrono::steady_clock::time_point now) {
+        record(turn, kJournalTurnEnd, 0, now);
+    }
+
+    void flush() {
+        size_t written = 0;
+        while (fd >= 0 && written < size) {
+            ssize_t result = write(fd, buffer + written, size - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break; // Disk trouble, the rest of the journal is lost
+            written += result;
+        }
+        size = 0;
+    }
+
+    ~JournalWriter() {
+        flush();
+        if (fd >= 0) close(fd);
+    }
+};
+
+// A journal read back into memory
+struct Journal {
+    uint32_t roomId = 0;
+    uint64_t startTime = 0; // Unix microseconds
+    GameState initial{0, 0};
+    std::vector<JournalRecord> records;
+};
+
+// Returns false if the file is missing or not a journal. A truncated tail, e.g. from a server
+// that was killed mid-match, is ignored.
+inline bool loadJournal(const std::string& path, Journal& journal) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    std::vector<uint8_t> data;
+    uint8_t chunk[64 * 1024];
+    ssize_t result;
+    while ((result = read(fd, chunk, sizeof(chunk))) > 0) {
+        data.insert(data.end(), chunk, chunk + result);
+    }
+    close(fd);
+
+    size_t offset = 0;
+    bool valid = true;
+    auto take = [&](size_t length) -> const uint8_t* {
+        if (!valid || data.size() - offset < length) {
+            valid = false;
+            return nullptr;
+        }
+        offset += length;
+        return data.data() + offset - length;
+    };
+    auto u8 = [&]() -> uint8_t {
+        const uint8_t* p = take(1);
+        return p ? p[0] : 0;
+    };
+    auto u16 = [&]() -> uint16_t {
+        const uint8_t* p = take(2);
+        return p ? static_cast<uint16_t>(p[0] | (p[1] << 8)) : 0;
+    };
+    auto u32 = [&]() -> uint32_t {
+        uint32_t low = u16();
+        return low | (static_cast<uint32_t>(u16()) << 16);
+    };
+
+    const uint8_t* magic = take(sizeof(kJournalMagic));
+    if (!magic || std::memcmp(magic, kJournalMagic, sizeof(kJournalMagic)) != 0) return false;
+    journal.roomId = u32();
+    uint64_t startLow = u32();
+    journal.startTime = startLow | (static_cast<uint64_t>(u32()) << 32);
+    int width = u16();
+    int height = u16();
+    int count = u8();
+    journal.initial = GameState(width, height);
+    for (int id = 0; id < count && valid; ++id) {
+        char character = u8();
+        uint8_t color = u8();
+        int x = u16();
+        int y = u16();
+        uint8_t nameLength = u8();
+        const uint8_t* name = take(nameLength);
+        if (!valid) break;
+        journal.initial.addPlayer(std::string_view(reinterpret_cast<const char*>(name), nameLength), character, x, y,
+                                  color);
+    }
+    if (!valid) return false;
+
+    journal.records.clear();
+    journal.records.reserve((data.size() - offset) / kJournalRecordSize);
+    while (data.size() - offset >= kJournalRecordSize) {
+        JournalRecord record;
+        record.turn = u32();
+        record.playerId = u8();
+        record.opcode = u8();
+        record.deltaMs = u16();
+        journal.records.push_back(record);
+    }
+    return true;
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Asynchronous logger. Threads format their messages into a ring buffer of their own, a background
+// thread timestamps them and writes them out in batches, so logging from the game loop never takes
+// a lock, formats a date or makes a syscall.
+//
+// Levels below LOG_LEVEL are compiled out, e.g. build with -DLOG_LEVEL=LOG_LEVEL_INFO to drop the
+// per-turn trace lines.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, ...) do { if constexpr ((level) >= LOG_LEVEL) logMessage(__VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Single producer, single consumer byte ring holding one thread's pending messages.
+// Records are 16-byte aligned and never wrap, a record with length 0 pads to the end of the ring.
+class LogRing {
+private:
+    struct Header {
+        uint32_t length; // Message bytes after the header, 0 for padding
+        uint32_t reserved;
+        int64_t timeNs;  // Wall clock time the message was logged at
+    };
+
+    static const size_t kCapacity = 64 * 1024;
+
+    alignas(64) std::atomic<uint64_t> head{0}; // Written by the owning thread
+    alignas(64) std::atomic<uint64_t> tail{0}; // Written by the log writer
+    std::atomic<uint64_t> dropped{0};
+    std::unique_ptr<uint8_t[]> storage{new uint8_t[kCapacity]};
+
+    static size_t recordSize(size_t length) {
+        return (sizeof(Header) + length + 15) & ~size_t(15);
+    }
+
+public:
+    static const size_t kMaxMessage = 4096;
+
+    // Called by the owning thread only. Drops the message if the writer has fallen too far behind.
+    void push(int64_t timeNs, const char* message, size_t length) {
+        uint64_t write = head.load(std::memory_order_relaxed);
+        size_t offset = write % kCapacity;
+        size_t needed = recordSize(length);
+        size_t padding = kCapacity - offset < needed ? kCapacity - offset : 0;
+        if (kCapacity - (write - tail.load(std::memory_order_acquire)) < padding + needed) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (padding > 0) {
+            Header pad = {0, 0, 0};
+            std::memcpy(storage.get() + offset, &pad, sizeof(pad));
+            write += padding;
+            offset = 0;
+        }
+        Header header = {static_cast<uint32_t>(length), 0, timeNs};
+        std::memcpy(storage.get() + offset, &header, sizeof(header));
+        std::memcpy(storage.get() + offset + sizeof(header), message, length);
+        head.store(write + needed, std::memory_order_release);
+    }
+
+    // Called by the writer only. Hands every complete record to onMessage, returns how many there were.
+    template <typename Handler>
+    size_t drain(Handler onMessage) {
+        uint64_t read = tail.load(std::memory_order_relaxed);
+        uint64_t end = head.load(std::memory_order_acquire);
+        size_t count = 0;
+        while (read != end) {
+            size_t offset = read % kCapacity;
+            Header header;
+            std::memcpy(&header, storage.get() + offset, sizeof(header));
+            if (header.length == 0) {
+                read += kCapacity - offset;
+                continue;
+            }
+            onMessage(header.timeNs, std::string_view(reinterpret_cast<const char*>(storage.get() + offset + sizeof(header)),
+                                                      header.length));
+            read += recordSize(header.length);
+            count++;
+        }
+        tail.store(read, std::memory_order_release);
+        return count;
+    }
+
+    uint64_t takeDropped() {
+        return dropped.exchange(0, std::memory_order_relaxed);
+    }
+};
+
+class Logger {
+private:
+    std::mutex ringsMutex; // Only taken when a thread logs for the first time, and by the writer
+    std::vector<std::unique_ptr<LogRing>> rings;
+    std::atomic<FILE*> output{stdout};
+    bool ownsOutput = false;
+    std::atomic<bool> running{true};
+
+    // Formatting the date is the expensive part, it only changes once per second
+    int64_t cachedSecond = -1;
+    char cachedTimestamp[32] = {};
+
+    std::thread writer; // Declared last, it starts running in the constructor
+
+    const char* timestamp(int64_t timeNs) {
+        int64_t second = timeNs / 1000000000;
+        if (second != cachedSecond) {
+            time_t seconds = second;
+            struct tm local;
+            localtime_r(&seconds, &local);
+            strftime(cachedTimestamp, sizeof(cachedTimestamp), "%Y-%m-%d %X", &local); // Format: YYYY-MM-DD HH:mm:ss
+            cachedSecond = second;
+        }
+        return cachedTimestamp;
+    }
+
+    // Writes out everything logged so far, returns false if there was nothing
+    bool flushRings(std::string& batch) {
+        batch.clear();
+        std::lock_guard<std::mutex> guard(ringsMutex);
+        for (auto& ring : rings) {
+            ring->drain([&](int64_t timeNs, std::string_view message) {
+                batch += '[';
+                batch += timestamp(timeNs);
+                batch += "] ";
+                batch += message;
+                batch += '\n';
+            });
+            if (uint64_t dropped = ring->takeDropped()) {
+                auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch());
+                batch += "[" + std::string(timestamp(now.count())) + "] " + std::to_string(dropped) + " log messages dropped\n";
+            }
+        }
+        if (batch.empty()) return false;
+        FILE* file = output.load();
+        fwrite(batch.data(), 1, batch.size(), file);
+        fflush(file);
+        return true;
+    }
+
+    void run() {
+        std::string batch;
+        while (running.load(std::memory_order_relaxed)) {
+            if (!flushRings(batch)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        flushRings(batch);
+    }
+
+    Logger() : writer(&Logger::run, this) {}
+
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    // Sends the log to a file instead of stdout
+    bool open(const char* path) {
+        FILE* file = fopen(path, "w");
+        if (!file) return false;
+        std::lock_guard<std::mutex> guard(ringsMutex);
+        FILE* previous = output.exchange(file);
+        if (ownsOutput) fclose(previous);
+        ownsOutput = true;
+        return true;
+    }
+
+    LogRing& threadRing() {
+        thread_local LogRing* ring = nullptr;
+        if (!ring) {
+            std::lock_guard<std::mutex> guard(ringsMutex);
+            rings.push_back(std::make_unique<LogRing>());
+            ring = rings.back().get();
+        }
+        return *ring;
+    }
+
+    ~Logger() {
+        running = false;
+        writer.join();
+        if (ownsOutput) fclose(output.load());
+    }
+};
+
+// Fixed-size line that log arguments are formatted into without allocating
+class LogLine {
+private:
+    char buffer[LogRing::kMaxMessage];
+    size_t size = 0;
+
+public:
+    void append(std::string_view text) {
+        size_t length = std::min(text.size(), sizeof(buffer) - size);
+        std::memcpy(buffer + size, text.data(), length);
+        size += length;
+    }
+
+    template <typename T>
+    void appendValue(const T& value) {
+        if constexpr (std::is_same_v<T, char>) {
+            append(std::string_view(&value, 1));
+        } else if constexpr (std::is_same_v<T, bool>) {
+            append(value ? "true" : "false");
+        } else if constexpr (std::is_integral_v<T>) {
+            auto result = std::to_chars(buffer + size, buffer + sizeof(buffer), value);
+            if (result.ec == std::errc()) size = result.ptr - buffer;
+        } else {
+            append(std::string_view(value));
+        }
+    }
+
+    void clear() {
+        size = 0;
+    }
+
+    const char* data() const { return buffer; }
+    size_t length() const { return size; }
+};
+
+// Use the LOG_* macros so that filtered levels cost nothing
+template <typename... Args>
+void logMessage(const Args&... args) {
+    thread_local LogLine line;
+    line.clear();
+    (line.appendValue(args), ...);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now); // Served by the vDSO, no syscall
+    Logger::instance().threadRing().push(static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec,
+                                         line.data(), line.length());
+}
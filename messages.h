@@ -0,0 +1,173 @@
+#pragma once
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "protocol.h"
+#include "game.h"
+#include "interest.h"
+
+// Encoders for what the server tells clients about the game state, in both wire formats.
+// Text forms are appended to a caller-owned string, which allocates nothing once it has grown to
+// the size of the match, binary ones are written into a caller-owned FrameWriter.
+
+inline std::string createPlayerList(const GameState& game, int slots) {
+    std::string playerList;
+    for (int i = 0; i < slots; ++i) {
+        if (i < game.playerCount()) {
+            playerList += std::string(game.name(i)) + ", " + game.character[i] + ";";
+        } else {
+            playerList += "Player " + std::to_string(i + 1) + ";";
+        }
+    }
+    return playerList;
+}
+
+inline void writePlayerList(FrameWriter& writer, const GameState& game, int slots) {
+    writer.begin(MessageType::PlayerList).u8(slots).u16(game.width).u16(game.height).u8(game.playerCount());
+    for (int id = 0; id < game.playerCount(); ++id) {
+        std::string_view name = game.name(id).substr(0, 0xFF);
+        writer.u8(id).u8(game.character[id]).u8(game.colorPair[id])
+              .u8(name.size()).bytes(name.data(), name.size());
+    }
+    writer.end();
+}
+
+inline void appendNumber(std::string& out, int value) {
+    char digits[16];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+// "username,character,moved;" per player
+inline void appendMoveStatus(std::string& out, const GameState& game) {
+    for (int id = 0; id < game.playerCount(); ++id) {
+        out += game.name(id);
+        out += ',';
+        out += game.character[id];
+        out += ',';
+        out += game.hasMoved(id) ? '1' : '0';
+        out += ';';
+    }
+}
+
+inline std::string createMoveStatus(const GameState& game) {
+    std::string status;
+    appendMoveStatus(status, game);
+    return status;
+}
+
+inline std::string generateMoveStatus(const GameState& game) {
+    return createMoveStatus(game);
+}
+
+// 'P' message body, "x,y,character,color;" per player
+inline void appendPositions(std::string& out, const GameState& game) {
+    for (int id = 0; id < game.playerCount(); ++id) {
+        if (game.isEliminated(id)) {
+            out += game.character[id];
+            out += "X;"; // Indicate elimination
+        } else {
+            appendNumber(out, game.x[id]);
+            out += ',';
+            appendNumber(out, game.y[id]);
+            out += ',';
+            out += game.character[id];
+            out += ',';
+            appendNumber(out, game.colorPair[id]);
+            out += ';';
+        }
+    }
+}
+
+// The same for a recorded state, characters and colors come from game
+inline void appendPositions(std::string& out, const GameState& game, const std::vector<PositionRecord>& records) {
+    for (const auto& record : records) {
+        int id = record.playerId;
+        if (record.flags & kPositionEliminated) {
+            out += game.character[id];
+            out += "X;";
+        } else {
+            appendNumber(out, record.x);
+            out += ',';
+            appendNumber(out, record.y);
+            out += ',';
+            out += game.character[id];
+            out += ',';
+            appendNumber(out, game.colorPair[id]);
+            out += ';';
+        }
+    }
+}
+
+inline std::string generatePositions(const GameState& game) {
+    std::string positions;
+    appendPositions(positions, game);
+    return positions;
+}
+
+inline PositionRecord makePositionRecord(const GameState& game, int id) {
+    return {static_cast<uint8_t>(id), game.x[id], game.y[id],
+            game.isEliminated(id) ? kPositionEliminated : uint8_t(0)};
+}
+
+// Full state keyframe
+inline void writePositions(FrameWriter& writer, uint32_t turn, const std::vector<PositionRecord>& records) {
+    writer.begin(MessageType::Positions).u32(turn).u8(records.size());
+    for (const auto& record : records) {
+        writer.position(record);
+    }
+    writer.end();
+}
+
+// Only the players that moved, were eliminated or spawned since the base state
+inline void writeDelta(FrameWriter& writer, uint32_t turn, uint32_t baseTurn,
+                       const std::vector<PositionRecord>& base, const std::vector<PositionRecord>& records) {
+    auto changed = [&](size_t i) { return i >= base.size() || base[i] != records[i]; };
+    uint8_t count = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        count += changed(i);
+    }
+
+    writer.begin(MessageType::Delta).u32(turn).u8(turn - baseTurn).u8(count);
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (changed(i)) {
+            writer.position(records[i]);
+        }
+    }
+    writer.end();
+}
+
+// Keyframe of the players in view
+inline void writePositions(FrameWriter& writer, uint32_t turn, const std::vector<PositionRecord>& records,
+                           const PlayerSet& visible) {
+    writer.begin(MessageType::Positions).u32(turn).u8(visible.size());
+    visible.forEach([&](int id) { writer.position(records[id]); });
+    writer.end();
+}
+
+// Only the players in view that changed since the base state or came into view, then the ones that
+// went out of view at their last position the client was sent, flagged kPositionLeftView
+inline void writeDelta(FrameWriter& writer, uint32_t turn, uint32_t baseTurn,
+                       const std::vector<PositionRecord>& base, const PlayerSet& baseVisible,
+                       const std::vector<PositionRecord>& records, const PlayerSet& visible) {
+    auto changed = [&](int id) {
+        return visible.test(id) != baseVisible.test(id) || (visible.test(id) && base[id] != records[id]);
+    };
+    uint8_t count = 0;
+    visible.forEachIn(baseVisible, [&](int id) { count += changed(id); });
+
+    writer.begin(MessageType::Delta).u32(turn).u8(turn - baseTurn).u8(count);
+    visible.forEachIn(baseVisible, [&](int id) {
+        if (!changed(id)) return;
+        if (visible.test(id)) {
+            writer.position(records[id]);
+        } else {
+            PositionRecord left = base[id];
+            left.flags |= kPositionLeftView;
+            writer.position(left);
+        }
+    });
+    writer.end();
+}
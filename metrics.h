@@ -0,0 +1,310 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "protocol.h"
+
+// Server metrics. Every thread records into a shard of its own and only that thread ever writes
+// it, so recording is a plain load and store with no lock or locked instruction. The exporter
+// thread sums the shards whenever someone asks and writes them out in the Prometheus text format,
+// to a UNIX domain socket (one dump per connection) and/or a file rewritten periodically.
+
+// A value written by one thread and read by the exporter
+class Counter {
+private:
+    std::atomic<uint64_t> value{0};
+
+public:
+    void add(uint64_t amount = 1) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t newValue) {
+        value.store(newValue, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Histogram of microsecond durations with HDR-style buckets: values below 16 get a bucket each and
+// every power of two above is split into 16 buckets, so a recorded value is known to within 1/16.
+// Values past 2^40 us (twelve days) land in the last bucket.
+class Histogram {
+public:
+    static constexpr int kSubBits = 4;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    static constexpr int kMaxBits = 40;
+    static constexpr int kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+    static int bucketOf(uint64_t value) {
+        if (value < kSubBuckets) return value;
+        int topBit = 63 - __builtin_clzll(value);
+        if (topBit >= kMaxBits) return kBuckets - 1;
+        int shift = topBit - kSubBits;
+        return (shift + 1) * kSubBuckets + static_cast<int>((value >> shift) - kSubBuckets);
+    }
+
+    // Largest value that falls in the bucket
+    static uint64_t highestIn(int bucket) {
+        if (bucket < kSubBuckets) return bucket;
+        int shift = bucket / kSubBuckets - 1;
+        uint64_t lowest = static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+
+    Counter buckets[kBuckets];
+    Counter count;
+    Counter sum;
+
+    void record(uint64_t value) {
+        buckets[bucketOf(value)].add();
+        count.add();
+        sum.add(value);
+    }
+
+    void record(std::chrono::steady_clock::duration duration) {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        record(static_cast<uint64_t>(micros > 0 ? micros : 0));
+    }
+};
+
+struct MetricsShard {
+    Counter bytesIn, bytesOut;
+    Counter messagesIn[kMessageTypes];  // By MessageType, text messages count as their binary equivalent
+    Counter messagesOut[kMessageTypes];
+    Counter turns;
+    Counter eliminations;
+    Counter activeRooms; // Matches the thread is running right now
+    Counter stateResends; // States sent again over UDP because the client had not acknowledged them
+    Counter skippedTicks; // Real-time ticks a busy thread woke up too late for
+    Counter spectators;   // Connections that started watching a match
+    Counter skippedSnapshots; // States a slow spectator never got because a newer one replaced them
+    Histogram inputLatency;  // Last input of a turn to its positions being sent
+    Histogram turnDuration;  // Previous turn's resolution to this one's
+    Histogram broadcastTime; // Encoding the positions of a turn and queuing them for every client
+};
+
+class Metrics {
+private:
+    std::mutex shardsMutex; // Only taken when a thread records for the first time, and by the exporter
+    std::vector<std::unique_ptr<MetricsShard>> shards;
+    std::thread exporter;
+    int listenFd = -1;
+
+    Metrics() = default;
+
+    // Sums a histogram over all shards and writes it as a summary, in seconds
+    void writeSummary(std::string& out, const char* name, const char* help, Histogram MetricsShard::*field) {
+        std::vector<uint64_t> merged(Histogram::kBuckets);
+        uint64_t count = 0, sum = 0;
+        for (auto& shard : shards) {
+            const Histogram& histogram = (*shard).*field;
+            for (int i = 0; i < Histogram::kBuckets; ++i) {
+                merged[i] += histogram.buckets[i].get();
+            }
+            count += histogram.count.get();
+            sum += histogram.sum.get();
+        }
+
+        char line[256];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+        out += line;
+        uint64_t total = 0;
+        for (int i = 0; i < Histogram::kBuckets; ++i) {
+            total += merged[i];
+        }
+        for (double quantile : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+            double seconds = 0;
+            if (total > 0) {
+                uint64_t rank = static_cast<uint64_t>(quantile * (total - 1)) + 1;
+                uint64_t seen = 0;
+                for (int i = 0; i < Histogram::kBuckets; ++i) {
+                    seen += merged[i];
+                    if (seen >= rank) {
+                        seconds = Histogram::highestIn(i) / 1e6;
+                        break;
+                    }
+                }
+            }
+            snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.6f\n", name, quantile, seconds);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n", name, sum / 1e6, name,
+                 static_cast<unsigned long long>(count));
+        out += line;
+    }
+
+    void writeCounter(std::string& out, const char* name, const char* help, const char* type,
+                      Counter MetricsShard::*field) {
+        uint64_t total = 0;
+        for (auto& shard : shards) {
+            total += ((*shard).*field).get();
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+                 static_cast<unsigned long long>(total));
+        out += line;
+    }
+
+    void writeMessages(std::string& out, const char* name, const char* help, Counter (MetricsShard::*field)[kMessageTypes],
+                       std::initializer_list<std::pair<MessageType, const char*>> types) {
+        char line[256];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+        out += line;
+        for (const auto& [type, label] : types) {
+            uint64_t total = 0;
+            for (auto& shard : shards) {
+                total += ((*shard).*field)[static_cast<int>(type)].get();
+            }
+            snprintf(line, sizeof(line), "%s{type=\"%s\"} %llu\n", name, label, static_cast<unsigned long long>(total));
+            out += line;
+        }
+    }
+
+    bool writeAll(int fd, const std::string& text) {
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t result = write(fd, text.data() + written, text.size() - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) return false;
+            written += result;
+        }
+        return true;
+    }
+
+    // Written next to the file and renamed over it, so readers never see half a dump
+    void dumpToFile(const std::string& path) {
+        std::string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "w");
+        if (!file) return;
+        std::string text = render();
+        bool complete = fwrite(text.data(), 1, text.size(), file) == text.size();
+        complete = fclose(file) == 0 && complete;
+        if (complete) rename(temporary.c_str(), path.c_str());
+    }
+
+    void run(std::string filePath, std::chrono::seconds interval) {
+        auto nextDump = std::chrono::steady_clock::now();
+        while (true) {
+            int timeoutMs = -1;
+            if (!filePath.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= nextDump) {
+                    dumpToFile(filePath);
+                    nextDump = now + interval;
+                }
+                timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(nextDump - now).count();
+            }
+            if (listenFd < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+                continue;
+            }
+            struct pollfd listener = {listenFd, POLLIN, 0};
+            if (poll(&listener, 1, timeoutMs) <= 0) continue;
+            int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            writeAll(client, render());
+            close(client);
+        }
+    }
+
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    MetricsShard& threadShard() {
+        thread_local MetricsShard* shard = nullptr;
+        if (!shard) {
+            std::lock_guard<std::mutex> guard(shardsMutex);
+            shards.push_back(std::make_unique<MetricsShard>());
+            shard = shards.back().get();
+        }
+        return *shard;
+    }
+
+    // Everything recorded so far, in the Prometheus text exposition format
+    std::string render() {
+        std::string out;
+        std::lock_guard<std::mutex> guard(shardsMutex);
+        writeCounter(out, "arena_received_bytes_total", "Bytes read from client sockets.", "counter",
+                     &MetricsShard::bytesIn);
+        writeCounter(out, "arena_sent_bytes_total", "Bytes written to client sockets.", "counter",
+                     &MetricsShard::bytesOut);
+        writeMessages(out, "arena_received_messages_total", "Messages received from clients by type.",
+                      &MetricsShard::messagesIn,
+                      {{MessageType::Hello, "hello"}, {MessageType::Command, "command"},
+                       {MessageType::Shutdown, "shutdown"}, {MessageType::Ack, "ack"},
+                       {MessageType::KeyframeRequest, "keyframe_request"}, {MessageType::DatagramOpen, "datagram_open"},
+                       {MessageType::DatagramBind, "datagram_bind"}, {MessageType::Inputs, "inputs"},
+                       {MessageType::Watch, "watch"}});
+        writeMessages(out, "arena_sent_messages_total", "Messages sent to clients by type.", &MetricsShard::messagesOut,
+                      {{MessageType::Taken, "taken"}, {MessageType::PlayerList, "player_list"},
+                       {MessageType::MoveMade, "move_made"}, {MessageType::Positions, "positions"},
+                       {MessageType::Delta, "delta"}, {MessageType::Eliminated, "eliminated"},
+                       {MessageType::DatagramOffer, "datagram_offer"}, {MessageType::DatagramBind, "datagram_bind"},
+                       {MessageType::InputAck, "input_ack"}});
+        writeCounter(out, "arena_turns_total", "Turns resolved.", "counter", &MetricsShard::turns);
+        writeCounter(out, "arena_eliminations_total", "Players eliminated by an attack.", "counter",
+                     &MetricsShard::eliminations);
+        writeCounter(out, "arena_state_resends_total", "States sent again over UDP because the client had not acknowledged them.",
+                     "counter", &MetricsShard::stateResends);
+        writeCounter(out, "arena_skipped_ticks_total", "Real-time ticks skipped because the thread woke up too late for them.",
+                     "counter", &MetricsShard::skippedTicks);
+        writeCounter(out, "arena_spectators_total", "Connections that started watching a match.", "counter",
+                     &MetricsShard::spectators);
+        writeCounter(out, "arena_skipped_snapshots_total", "States slow spectators skipped for a newer one.", "counter",
+                     &MetricsShard::skippedSnapshots);
+        writeCounter(out, "arena_active_rooms", "Matches being played.", "gauge", &MetricsShard::activeRooms);
+        writeSummary(out, "arena_input_to_resolution_seconds",
+                     "Time from the last input of a turn to its positions being sent.", &MetricsShard::inputLatency);
+        writeSummary(out, "arena_turn_duration_seconds", "Time from one turn's resolution to the next.",
+                     &MetricsShard::turnDuration);
+        writeSummary(out, "arena_broadcast_seconds", "Time spent encoding a turn's positions and queuing them for every client.",
+                     &MetricsShard::broadcastTime);
+        return out;
+    }
+
+    // Starts serving the metrics on a UNIX domain socket and/or dumping them to a file every interval.
+    // Returns false if the socket cannot be created.
+    bool startExporter(const std::string& socketPath, const std::string& filePath, std::chrono::seconds interval) {
+        if (socketPath.empty() && filePath.empty()) return true;
+        if (!socketPath.empty()) {
+            struct sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (socketPath.size() >= sizeof(address.sun_path)) return false;
+            socketPath.copy(address.sun_path, socketPath.size());
+
+            listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            unlink(socketPath.c_str()); // Left behind by a previous run
+            if (listenFd < 0 || bind(listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0 ||
+                listen(listenFd, 16) < 0) {
+                return false;
+            }
+        }
+        exporter = std::thread(&Metrics::run, this, filePath, interval);
+        exporter.detach();
+        return true;
+    }
+};
+
+inline MetricsShard& metrics() {
+    return Metrics::instance().threadShard();
+}
@@ -0,0 +1,342 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Lossy network between clients and a server on one machine, for trying out the game and UDP mode
+// (see datagram.h) under packet loss. Listens on one port for TCP and UDP like the server and
+// forwards both to it:
+//
+//   ./netshim --listen 23456 --server 12345 --loss 0.02 --delay 20 --jitter 5
+//
+// Every datagram and every chunk of a TCP stream takes the delay plus up to the jitter, each way.
+//  - Datagrams are dropped with the loss probability, and jitter may reorder them.
+//  - TCP never loses data, so the shim plays out what the kernel makes of a lost segment: the chunk
+//    waits for a retransmission timeout (--rto, 200 ms by default, the Linux minimum) on top of the
+//    delay, doubled for every retransmission lost as well, and everything after it on the connection
+//    waits behind it. This is a model, it does not shrink the window or slow down like a real sender.
+
+using Clock = std::chrono::steady_clock;
+
+struct ShimOptions {
+    int listenPort = 0;
+    int serverPort = 0;
+    std::string serverHost = "127.0.0.1";
+    double loss = 0;
+    int delayMs = 0;
+    int jitterMs = 0;
+    int rtoMs = 200;
+};
+
+// One direction of a proxied TCP connection. Chunks leave in order, each once its time has come.
+struct Stream {
+    struct Chunk {
+        Clock::time_point at;
+        std::string bytes;
+    };
+
+    int from, to;
+    std::deque<Chunk> chunks;
+    size_t written = 0; // Of the first chunk
+    bool ended = false; // from is closed, to is shut down once everything went out
+};
+
+struct Connection {
+    Stream up, down; // Client to server, server to client
+};
+
+struct Datagram {
+    Clock::time_point at;
+    int fd;
+    bool toClient;
+    struct sockaddr_in client;
+    std::string bytes;
+
+    bool operator>(const Datagram& other) const {
+        return at > other.at;
+    }
+};
+
+class Shim {
+private:
+    const ShimOptions& options;
+    struct sockaddr_in server = {};
+    int epoll_fd;
+    int tcpListener;
+    int udpListener;
+    std::mt19937 rng{std::random_device{}()};
+    std::unordered_map<int, std::shared_ptr<Connection>> connections; // Both sockets of each connection
+    std::unordered_map<uint64_t, int> relays;  // Client address to the socket that talks to the server for it
+    std::unordered_map<int, struct sockaddr_in> relayClients;
+    std::priority_queue<Datagram, std::vector<Datagram>, std::greater<Datagram>> datagrams;
+
+    bool lost() {
+        return std::uniform_real_distribution<double>(0, 1)(rng) < options.loss;
+    }
+
+    Clock::time_point arrival(Clock::time_point now) {
+        int jitter = options.jitterMs > 0 ? std::uniform_int_distribution<int>(0, options.jitterMs)(rng) : 0;
+        return now + std::chrono::milliseconds(options.delayMs + jitter);
+    }
+
+    void watch(int fd) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void acceptClient() {
+        int client = accept4(tcpListener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return;
+        int upstream = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (upstream < 0 || connect(upstream, (struct sockaddr *)&server, sizeof(server)) < 0) {
+            std::cerr << "Cannot reach the server." << std::endl;
+            close(client);
+            if (upstream >= 0) close(upstream);
+            return;
+        }
+        fcntl(upstream, F_SETFL, fcntl(upstream, F_GETFL, 0) | O_NONBLOCK);
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        auto connection = std::make_shared<Connection>();
+        connection->up.from = connection->down.to = client;
+        connection->up.to = connection->down.from = upstream;
+        connections[client] = connection;
+        connections[upstream] = connection;
+        watch(client);
+        watch(upstream);
+    }
+
+    void readStream(Stream& stream, Clock::time_point now) {
+        char buffer[16384];
+        ssize_t size = recv(stream.from, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (size <= 0) {
+            stream.ended = true;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream.from, nullptr);
+            return;
+        }
+        Clock::time_point at = arrival(now);
+        for (int rto = options.rtoMs; lost(); rto *= 2) {
+            at += std::chrono::milliseconds(rto);
+        }
+        if (!stream.chunks.empty()) {
+            at = std::max(at, stream.chunks.back().at); // In order, behind whatever is still held up
+        }
+        stream.chunks.push_back({at, std::string(buffer, size)});
+    }
+
+    // Writes the chunks that are due. Returns false if the receiver is not keeping up.
+    bool writeStream(Stream& stream, Clock::time_point now) {
+        while (!stream.chunks.empty() && stream.chunks.front().at <= now) {
+            const std::string& bytes = stream.chunks.front().bytes;
+            ssize_t sent = send(stream.to, bytes.data() + stream.written, bytes.size() - stream.written,
+                                MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0) return errno != EAGAIN;
+            stream.written += sent;
+            if (stream.written < bytes.size()) return false;
+            stream.chunks.pop_front();
+            stream.written = 0;
+        }
+        if (stream.chunks.empty() && stream.ended) {
+            shutdown(stream.to, SHUT_WR);
+        }
+        return true;
+    }
+
+    void closeConnection(const std::shared_ptr<Connection>& connection) {
+        for (int fd : {connection->up.from, connection->down.from}) {
+            close(fd);
+            connections.erase(fd);
+        }
+    }
+
+    void readDatagrams(int fd, Clock::time_point now) {
+        char buffer[65536];
+        while (true) {
+            struct sockaddr_in client = {};
+            socklen_t length = sizeof(client);
+            ssize_t size = recvfrom(fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&client, &length);
+            if (size < 0 && (errno == EINTR || errno == ECONNREFUSED)) continue;
+            if (size < 0) return;
+
+            Datagram datagram;
+            datagram.toClient = fd != udpListener;
+            if (datagram.toClient) {
+                datagram.fd = udpListener;
+                datagram.client = relayClients[fd];
+            } else {
+                datagram.fd = relayFor(client);
+                if (datagram.fd < 0) continue;
+            }
+            if (lost()) continue;
+            datagram.at = arrival(now);
+            datagram.bytes.assign(buffer, size);
+            datagrams.push(std::move(datagram));
+        }
+    }
+
+    // Each client address gets a socket of its own towards the server, so the server tells them apart
+    int relayFor(const struct sockaddr_in& client) {
+        uint64_t key = (static_cast<uint64_t>(client.sin_addr.s_addr) << 16) | client.sin_port;
+        auto it = relays.find(key);
+        if (it != relays.end()) return it->second;
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        relays[key] = fd;
+        relayClients[fd] = client;
+        watch(fd);
+        return fd;
+    }
+
+    void sendDatagrams(Clock::time_point now) {
+        while (!datagrams.empty() && datagrams.top().at <= now) {
+            const Datagram& datagram = datagrams.top();
+            if (datagram.toClient) {
+                sendto(datagram.fd, datagram.bytes.data(), datagram.bytes.size(), MSG_DONTWAIT,
+                       (const struct sockaddr *)&datagram.client, sizeof(datagram.client));
+            } else {
+                send(datagram.fd, datagram.bytes.data(), datagram.bytes.size(), MSG_DONTWAIT);
+            }
+            datagrams.pop();
+        }
+    }
+
+    // Until the next chunk or datagram is due, 1 ms while a receiver is not keeping up
+    int timeoutMs(Clock::time_point now, bool blocked) {
+        Clock::time_point next = Clock::time_point::max();
+        if (!datagrams.empty()) next = datagrams.top().at;
+        for (const auto& pair : connections) {
+            for (const Stream* stream : {&pair.second->up, &pair.second->down}) {
+                if (!stream->chunks.empty()) next = std::min(next, stream->chunks.front().at);
+            }
+        }
+        if (blocked) return 1;
+        if (next == Clock::time_point::max()) return -1;
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(next - now).count();
+        return left > 0 ? static_cast<int>((left + 999) / 1000) : 0;
+    }
+
+    static int openListener(int type, int port) {
+        int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+public:
+    explicit Shim(const ShimOptions& options) : options(options) {
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.serverPort);
+        inet_pton(AF_INET, options.serverHost.c_str(), &server.sin_addr);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        tcpListener = openListener(SOCK_STREAM, options.listenPort);
+        udpListener = openListener(SOCK_DGRAM, options.listenPort);
+    }
+
+    bool ready() const {
+        return tcpListener >= 0 && udpListener >= 0;
+    }
+
+    void run() {
+        watch(tcpListener);
+        watch(udpListener);
+        std::vector<struct epoll_event> events(256);
+        bool blocked = false;
+        while (true) {
+            int ready = epoll_wait(epoll_fd, events.data(), events.size(), timeoutMs(Clock::now(), blocked));
+            auto now = Clock::now();
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == tcpListener) {
+                    acceptClient();
+                } else if (fd == udpListener || relayClients.count(fd)) {
+                    readDatagrams(fd, now);
+                } else {
+                    auto it = connections.find(fd);
+                    if (it == connections.end()) continue;
+                    readStream(fd == it->second->up.from ? it->second->up : it->second->down, now);
+                }
+            }
+
+            sendDatagrams(now);
+            blocked = false;
+            std::vector<std::shared_ptr<Connection>> done;
+            for (const auto& pair : connections) {
+                if (pair.first != pair.second->up.from) continue; // Each connection once
+                Connection& connection = *pair.second;
+                for (Stream* stream : {&connection.up, &connection.down}) {
+                    blocked |= !writeStream(*stream, now);
+                }
+                if (connection.up.ended && connection.down.ended &&
+                    connection.up.chunks.empty() && connection.down.chunks.empty()) {
+                    done.push_back(pair.second);
+                }
+            }
+            for (const auto& connection : done) {
+                closeConnection(connection);
+            }
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    ShimOptions options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--listen") options.listenPort = std::atoi(value.c_str());
+        else if (option == "--server") options.serverPort = std::atoi(value.c_str());
+        else if (option == "--host") options.serverHost = value;
+        else if (option == "--loss") options.loss = std::atof(value.c_str());
+        else if (option == "--delay") options.delayMs = std::atoi(value.c_str());
+        else if (option == "--jitter") options.jitterMs = std::atoi(value.c_str());
+        else if (option == "--rto") options.rtoMs = std::atoi(value.c_str());
+    }
+    if (options.listenPort <= 0 || options.serverPort <= 0 || options.loss < 0 || options.loss >= 1 ||
+        options.delayMs < 0 || options.jitterMs < 0 || options.rtoMs < 1) {
+        std::cerr << "Usage: " << argv[0] << " --listen PORT --server PORT [--host 127.0.0.1] [--loss 0.0-0.99]"
+                  << " [--delay MS] [--jitter MS] [--rto 200]" << std::endl;
+        return 1;
+    }
+
+    Shim shim(options);
+    if (!shim.ready()) {
+        std::cerr << "Cannot listen on port " << options.listenPort << "." << std::endl;
+        return 1;
+    }
+    std::cout << "Forwarding port " << options.listenPort << " to " << options.serverHost << ":" << options.serverPort
+              << " with " << options.loss * 100 << "% loss, " << options.delayMs << "+" << options.jitterMs
+              << " ms delay each way." << std::endl;
+    shim.run();
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "pool.h"
+#include "protocol.h"
+
+// Outgoing side of a connection. A broadcast is encoded once into a SharedMessage and every
+// recipient's Outbox holds a reference to it. Outboxes are only flushed once the thread has handled
+// everything that woke it, so all the updates a client gets from one wakeup (the 'L' list updates,
+// an elimination, the turn's positions) leave in a single write and usually a single segment. The
+// write itself is up to the thread's Transport (see transport.h).
+//
+// Messages are refcounted by hand and recycled through a pool: a room and its messages belong to
+// one thread at a time, so nothing here is atomic and nothing is freed while a match runs. Each
+// MessageType has a pool of its own, so a recycled buffer goes to a message of about the size it
+// held before, e.g. a move list update is never handed a buffer that then has to grow for a keyframe.
+
+struct SharedMessage {
+    std::string bytes;       // Encoded message, keeps its capacity when recycled
+    MessageType type = MessageType::Positions; // Counted in the metrics under this type
+    int references = 0;
+};
+
+class MessagePool {
+private:
+    ObjectPool<SharedMessage> pools[kMessageTypes];
+
+public:
+    // The caller holds the first reference and drops it with unref() once the message is queued
+    SharedMessage* create(MessageType type) {
+        SharedMessage* message = pools[static_cast<int>(type)].acquire();
+        message->bytes.clear();
+        message->type = type;
+        message->references = 1;
+        return message;
+    }
+
+    void ref(SharedMessage* message) {
+        message->references++;
+    }
+
+    void unref(SharedMessage* message) {
+        if (--message->references == 0) pools[static_cast<int>(message->type)].release(message);
+    }
+};
+
+class Outbox {
+private:
+    struct Entry {
+        SharedMessage* message;
+        size_t offset; // Bytes of it already written
+    };
+
+    std::vector<Entry> entries;
+    size_t queuedBytes = 0;
+
+public:
+    static const int kMaxSegments = 64; // Messages per write
+
+    enum class FlushStatus {
+        Flushed, // Bytes were written
+        Blocked, // The socket buffer is full, flush again once the socket is writable
+        Failed   // The connection is gone, the read side will notice and drop it
+    };
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    // Bytes waiting to be written
+    size_t size() const {
+        return queuedBytes;
+    }
+
+    void push(MessagePool& pool, SharedMessage* message) {
+        if (message->bytes.empty()) return;
+        pool.ref(message);
+        entries.push_back({message, 0});
+        queuedBytes += message->bytes.size();
+    }
+
+    // Points segments at the queued bytes, at most maxSegments messages. Returns the number of segments.
+    int prepare(struct iovec* segments, int maxSegments) const {
+        int count = 0;
+        for (size_t i = 0; i < entries.size() && count < maxSegments; ++i) {
+            const Entry& entry = entries[i];
+            segments[count++] = {const_cast<char*>(entry.message->bytes.data()) + entry.offset,
+                                 entry.message->bytes.size() - entry.offset};
+        }
+        return count;
+    }
+
+    // Takes the outcome of writing what prepare() described, result is the number of bytes written or
+    // -1 with error set. Drops the references to the messages written in full.
+    FlushStatus complete(ssize_t result, int error, MessagePool& pool) {
+        if (result < 0) {
+            if (error == EAGAIN || error == EWOULDBLOCK) return FlushStatus::Blocked;
+            clear(pool); // Nothing more will get through
+            return FlushStatus::Failed;
+        }
+        size_t remaining = result;
+        size_t done = 0;
+        queuedBytes -= remaining;
+        while (remaining > 0) {
+            Entry& entry = entries[done];
+            size_t left = entry.message->bytes.size() - entry.offset;
+            if (remaining < left) {
+                entry.offset += remaining;
+                break;
+            }
+            remaining -= left;
+            pool.unref(entry.message);
+            done++;
+        }
+        entries.erase(entries.begin(), entries.begin() + done);
+        return FlushStatus::Flushed;
+    }
+
+    // Drops everything still queued
+    void clear(MessagePool& pool) {
+        for (const Entry& entry : entries) {
+            pool.unref(entry.message);
+        }
+        entries.clear();
+        queuedBytes = 0;
+    }
+};
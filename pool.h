@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Recycles objects instead of freeing them. Objects are built in chunks and stay constructed when
+// released, so whatever they own (e.g. a receive buffer) is reused along with them and handing one
+// out never allocates once the pool has grown to the peak demand. The caller resets the fields it
+// needs when it acquires an object.
+//
+// Not thread safe, each pool belongs to one thread.
+template <typename T>
+class ObjectPool {
+private:
+    static const size_t kChunkSize = 64;
+
+    std::vector<std::unique_ptr<T[]>> chunks;
+    std::vector<T*> available;
+
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    T* acquire() {
+        if (available.empty()) {
+            chunks.push_back(std::make_unique<T[]>(kChunkSize));
+            for (size_t i = kChunkSize; i > 0; --i) {
+                available.push_back(&chunks.back()[i - 1]);
+            }
+        }
+        T* object = available.back();
+        available.pop_back();
+        return object;
+    }
+
+    void release(T* object) {
+        available.push_back(object);
+    }
+
+    // Objects handed out right now
+    size_t inUse() const {
+        return chunks.size() * kChunkSize - available.size();
+    }
+};
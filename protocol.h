@@ -0,0 +1,261 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Binary wire protocol shared by the server and the client.
+//
+// A client opts in by sending kBinaryPreamble followed by a Hello frame, or a Watch frame to follow a
+// match without playing in it. Anything else is treated as the original text protocol ("username,char"
+// or "WATCH <room id>" handshake, '|' separated commands), which the server keeps speaking to that connection.
+//
+// Every frame is laid out as
+//   uint16 length | uint8 type | payload
+// where length counts the type byte plus the payload. Multi-byte fields are little endian.
+
+const uint8_t kProtocolVersion = 4;
+const uint8_t kBinaryPreamble[4] = {0x00, 'A', 'G', kProtocolVersion};
+const size_t kFrameHeaderSize = 3;
+const size_t kMaxFrameSize = 2 + 0xFFFF;
+
+enum class Protocol : uint8_t {
+    Text,
+    Binary
+};
+
+enum class MessageType : uint8_t {
+    Hello = 1,       // client -> server: u8 character, u8 name length, name
+    Taken = 2,       // server -> client: username or character already in use
+    PlayerList = 3,  // server -> client: u8 slots, u16 arena width, u16 arena height, u8 count, count x (u8 id, u8 character, u8 color, u8 name length, name)
+    MoveMade = 4,    // server -> client: u8 id, the player has sent its command for this turn ('L')
+    Positions = 5,   // server -> client: u32 turn, u8 count, count x PositionRecord, full state keyframe ('R|P')
+    Eliminated = 6,  // server -> client: u8 id ('E')
+    Command = 7,     // client -> server: u8 opcode
+    Shutdown = 8,    // client -> server: the match is over
+    Delta = 9,       // server -> client: u32 turn, u8 turns since base, u8 count, count x PositionRecord changed since base
+    Ack = 10,        // client -> server: u32 turn, the newest state the client has applied
+    KeyframeRequest = 11, // client -> server: the client lost track of the state and wants a full Positions frame
+    // UDP mode, see datagram.h
+    DatagramOpen = 12,  // client -> server: the client wants to use UDP as well
+    DatagramOffer = 13, // server -> client: u32 room id, u32 secret, to send in DatagramBind
+    DatagramBind = 14,  // client -> server over UDP: u32 room id, u32 secret, sent back once the server is ready
+    Inputs = 15,        // client -> server: u32 sequence number of the first, u8 count, count x u8 opcode
+    InputAck = 16,      // server -> client: u32 sequence number of the next command the server expects
+    Watch = 17          // client -> server: u32 room id, 0 for the newest match, sent instead of Hello by spectators
+};
+
+// Room for every MessageType value
+const int kMessageTypes = 18;
+
+enum class Opcode : uint8_t {
+    None = 0,
+    Up,
+    Down,
+    Left,
+    Right,
+    AttackTopLeft,
+    AttackTop,
+    AttackTopRight,
+    AttackLeft,
+    AttackRight,
+    AttackBottomLeft,
+    AttackBottom,
+    AttackBottomRight
+};
+
+// How many past turns the server can diff a Delta against, clients keep as many snapshots
+const uint32_t kSnapshotHistory = 32;
+
+// Wire size of one PositionRecord: u8 id, u16 x, u16 y, u8 flags
+const size_t kPositionRecordSize = 6;
+const uint8_t kPositionEliminated = 0x01;
+// With a view radius (see interest.h) a state only holds the players in view. A record for a player
+// the client does not have is one that came into view, this flag marks one that went out of it.
+const uint8_t kPositionLeftView = 0x02;
+
+struct PositionRecord {
+    uint8_t playerId;
+    uint16_t x;
+    uint16_t y;
+    uint8_t flags;
+
+    bool operator==(const PositionRecord& other) const {
+        return playerId == other.playerId && x == other.x && y == other.y && flags == other.flags;
+    }
+    bool operator!=(const PositionRecord& other) const {
+        return !(*this == other);
+    }
+};
+
+// Whether a byte read off the wire is a move or an attack, the only opcodes a client may send
+inline bool isCommandOpcode(uint8_t opcode) {
+    return opcode >= static_cast<uint8_t>(Opcode::Up) && opcode <= static_cast<uint8_t>(Opcode::AttackBottomRight);
+}
+
+// Text protocol spelling of each opcode, as sent by the original client
+inline const char* opcodeToText(Opcode opcode) {
+    static const char* const names[] = {"", "UP", "DOWN", "LEFT", "RIGHT", "E", "T", "Y", "F", "H", "C", "G", "B"};
+    uint8_t index = static_cast<uint8_t>(opcode);
+    return index < sizeof(names) / sizeof(names[0]) ? names[index] : "";
+}
+
+inline Opcode opcodeFromText(const char* text, size_t length) {
+    if (length == 0) return Opcode::None;
+    if (length == 1) {
+        switch (text[0]) {
+            case 'e': case 'E': return Opcode::AttackTopLeft;
+            case 't': case 'T': return Opcode::AttackTop;
+            case 'y': case 'Y': return Opcode::AttackTopRight;
+            case 'f': case 'F': return Opcode::AttackLeft;
+            case 'h': case 'H': return Opcode::AttackRight;
+            case 'c': case 'C': return Opcode::AttackBottomLeft;
+            case 'g': case 'G': return Opcode::AttackBottom;
+            case 'b': case 'B': return Opcode::AttackBottomRight;
+            default: break;
+        }
+    }
+    switch (text[0]) {
+        case 'U': return Opcode::Up;
+        case 'D': return Opcode::Down;
+        case 'L': return Opcode::Left;
+        case 'R': return Opcode::Right;
+        default: return Opcode::None;
+    }
+}
+
+// Appends frames to a caller-owned buffer. Writing past the capacity marks the writer as failed
+// instead of allocating, check ok() before sending.
+class FrameWriter {
+private:
+    uint8_t* buffer;
+    size_t capacity;
+    size_t size = 0;
+    size_t frameStart = 0;
+    bool failed = false;
+
+public:
+    FrameWriter(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    FrameWriter& begin(MessageType type) {
+        frameStart = size;
+        u16(0); // Patched by end()
+        return u8(static_cast<uint8_t>(type));
+    }
+
+    FrameWriter& end() {
+        size_t length = size - frameStart - 2;
+        if (failed || length > 0xFFFF) {
+            failed = true;
+            return *this;
+        }
+        buffer[frameStart] = length & 0xFF;
+        buffer[frameStart + 1] = length >> 8;
+        return *this;
+    }
+
+    FrameWriter& u8(uint8_t value) {
+        return bytes(&value, 1);
+    }
+
+    FrameWriter& u16(uint16_t value) {
+        uint8_t le[2] = {static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>(value >> 8)};
+        return bytes(le, 2);
+    }
+
+    FrameWriter& u32(uint32_t value) {
+        return u16(value & 0xFFFF).u16(value >> 16);
+    }
+
+    FrameWriter& bytes(const void* data, size_t length) {
+        if (failed || size + length > capacity) {
+            failed = true;
+            return *this;
+        }
+        std::memcpy(buffer + size, data, length);
+        size += length;
+        return *this;
+    }
+
+    FrameWriter& position(const PositionRecord& record) {
+        return u8(record.playerId).u16(record.x).u16(record.y).u8(record.flags);
+    }
+
+    void clear() {
+        size = 0;
+        failed = false;
+    }
+
+    bool ok() const { return !failed; }
+    const uint8_t* data() const { return buffer; }
+    size_t length() const { return size; }
+};
+
+struct Frame {
+    MessageType type;
+    const uint8_t* payload;
+    size_t payloadSize;
+    size_t totalSize; // Header included, i.e. how many bytes to consume
+};
+
+// Returns false until a whole frame is available at data. Never copies the payload.
+inline bool peekFrame(const uint8_t* data, size_t size, Frame& frame) {
+    if (size < kFrameHeaderSize) return false;
+    size_t length = data[0] | (static_cast<size_t>(data[1]) << 8);
+    if (length == 0 || size < 2 + length) return false;
+    frame.type = static_cast<MessageType>(data[2]);
+    frame.payload = data + kFrameHeaderSize;
+    frame.payloadSize = length - 1;
+    frame.totalSize = 2 + length;
+    return true;
+}
+
+// Bounds-checked cursor over a frame payload. Reading past the end yields zeros and clears good().
+class PayloadReader {
+private:
+    const uint8_t* cursor;
+    size_t remaining;
+    bool valid = true;
+
+public:
+    explicit PayloadReader(const Frame& frame) : cursor(frame.payload), remaining(frame.payloadSize) {}
+
+    const uint8_t* bytes(size_t length) {
+        if (length > remaining) {
+            valid = false;
+            remaining = 0;
+            return nullptr;
+        }
+        const uint8_t* start = cursor;
+        cursor += length;
+        remaining -= length;
+        return start;
+    }
+
+    uint8_t u8() {
+        const uint8_t* p = bytes(1);
+        return p ? p[0] : 0;
+    }
+
+    uint16_t u16() {
+        const uint8_t* p = bytes(2);
+        return p ? static_cast<uint16_t>(p[0] | (p[1] << 8)) : 0;
+    }
+
+    uint32_t u32() {
+        uint32_t low = u16();
+        return low | (static_cast<uint32_t>(u16()) << 16);
+    }
+
+    PositionRecord position() {
+        PositionRecord record;
+        record.playerId = u8();
+        record.x = u16();
+        record.y = u16();
+        record.flags = u8();
+        return record;
+    }
+
+    bool good() const { return valid; }
+    size_t left() const { return remaining; }
+};
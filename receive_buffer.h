@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "protocol.h"
+
+// Per-connection ring buffer that reassembles messages split or merged by TCP.
+//
+// Reads land directly in the free space of the ring. Complete messages are handed out as views
+// into the buffer, which stay valid until the next read or consume(). A message that wraps
+// around the end of the ring is made contiguous by rotating the buffered bytes once.
+class ReceiveBuffer {
+private:
+    std::vector<uint8_t> storage;
+    size_t start = 0; // Index of the first buffered byte
+    size_t count = 0; // Number of buffered bytes
+
+    size_t capacity() const {
+        return storage.size();
+    }
+
+    size_t writeIndex() const {
+        return (start + count) % capacity();
+    }
+
+    // Moves the buffered bytes to the front of the ring so they form one contiguous block
+    void linearize() {
+        if (start + count <= capacity()) return;
+        std::rotate(storage.begin(), storage.begin() + start, storage.end());
+        start = 0;
+    }
+
+public:
+    enum class ReadStatus {
+        Drained, // Socket has no more data for now
+        Full,    // Buffer filled up before the socket was drained, read again after consuming
+        Closed   // Peer closed the connection or the socket failed
+    };
+
+    explicit ReceiveBuffer(size_t capacity = 4096) : storage(capacity) {}
+
+    // Reads from a non-blocking socket until it would block or the ring is full.
+    // On a blocking socket this returns after the first successful read.
+    ReadStatus readFrom(int fd, bool blocking = false) {
+        while (count < capacity()) {
+            struct iovec segments[2];
+            int segmentCount = 1;
+            size_t write = writeIndex();
+            if (write >= start && (write != start || count == 0)) {
+                segments[0] = {storage.data() + write, capacity() - write};
+                if (start > 0) {
+                    segments[1] = {storage.data(), start};
+                    segmentCount = 2;
+                }
+            } else {
+                segments[0] = {storage.data() + write, start - write};
+            }
+
+            ssize_t bytes_read = readv(fd, segments, segmentCount);
+            if (bytes_read > 0) {
+                count += bytes_read;
+                if (blocking) return ReadStatus::Drained;
+            } else if (bytes_read == 0) {
+                return ReadStatus::Closed;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? ReadStatus::Drained : ReadStatus::Closed;
+            }
+        }
+        return ReadStatus::Full;
+    }
+
+    // Copies bytes in, for data that was read elsewhere (e.g. what followed a handshake, or a
+    // receive the transport completed)
+    bool append(const uint8_t* data, size_t length) {
+        if (length > capacity() - count) return false;
+        size_t write = writeIndex();
+        size_t first = std::min(length, capacity() - write); // Up to the end of the ring, the rest wraps
+        std::memcpy(storage.data() + write, data, first);
+        std::memcpy(storage.data(), data + first, length - first);
+        count += length;
+        return true;
+    }
+
+    // Finds the next complete binary frame. Consume frame.totalSize bytes once done with it.
+    bool nextFrame(Frame& frame) {
+        if (count < kFrameHeaderSize) return false;
+        size_t length = storage[start] | (static_cast<size_t>(storage[(start + 1) % capacity()]) << 8);
+        if (count < 2 + length) return false;
+        linearize();
+        return peekFrame(storage.data() + start, count, frame);
+    }
+
+    // Finds the next message terminated by delimiter, the view excludes the delimiter.
+    // Consume message.size() + 1 bytes once done with it.
+    bool nextDelimited(char delimiter, std::string_view& message) {
+        size_t firstPart = std::min(count, capacity() - start);
+        const uint8_t* first = storage.data() + start;
+        const void* found = std::memchr(first, delimiter, firstPart);
+        size_t length;
+        if (found) {
+            length = static_cast<const uint8_t*>(found) - first;
+        } else {
+            found = std::memchr(storage.data(), delimiter, count - firstPart);
+            if (!found) return false;
+            length = firstPart + (static_cast<const uint8_t*>(found) - storage.data());
+            linearize();
+        }
+        message = std::string_view(reinterpret_cast<const char*>(storage.data() + start), length);
+        return true;
+    }
+
+    // Everything buffered as one message, for peers that do not delimit their messages
+    std::string_view all() {
+        linearize();
+        return std::string_view(reinterpret_cast<const char*>(storage.data() + start), count);
+    }
+
+    void consume(size_t length) {
+        length = std::min(length, count);
+        start = (start + length) % capacity();
+        count -= length;
+        if (count == 0) start = 0;
+    }
+
+    void clear() {
+        start = 0;
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == capacity(); }
+};
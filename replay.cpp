@@ -0,0 +1,141 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "protocol.h"
+#include "game.h"
+#include "messages.h"
+#include "journal.h"
+
+// Re-runs a match journal (see journal.h) through the server's turn resolution code, as fast as it goes.
+//   ./replay room-1.journal                  summary of the match
+//   ./replay room-1.journal --trace          every command, elimination and turn as it happened
+//   ./replay room-1.journal --repeat 100000  replay it over and over to measure turns per second
+
+struct ReplayResult {
+    uint64_t turns = 0;
+    uint64_t commands = 0;
+};
+
+// Text spelling of every opcode, built once so the replay loop never converts
+std::string commandNames[256];
+
+ReplayResult replay(const Journal& journal, GameState& game, bool trace) {
+    ReplayResult result;
+    uint64_t elapsedMs = 0;
+    for (const JournalRecord& record : journal.records) {
+        if (trace) {
+            elapsedMs += record.deltaMs;
+        }
+        if (record.playerId == kJournalTurnEnd) {
+            result.turns++;
+            if (trace) {
+                printf("%8.3fs turn %u: %s\n", elapsedMs / 1000.0, record.turn, generatePositions(game).c_str());
+            }
+            game.clearMoves();
+            continue;
+        }
+        if (record.playerId >= game.playerCount()) continue; // Corrupt record
+
+        int playerId = record.playerId;
+        if (record.opcode == kJournalDisconnect) {
+            game.eliminatePlayer(playerId);
+            if (trace) {
+                printf("%8.3fs %.*s disconnected\n", elapsedMs / 1000.0, static_cast<int>(game.name(playerId).size()),
+                       game.name(playerId).data());
+            }
+            continue;
+        }
+        if (record.opcode == kJournalShutdown) {
+            if (trace) {
+                printf("%8.3fs %.*s ended the match\n", elapsedMs / 1000.0,
+                       static_cast<int>(game.name(playerId).size()), game.name(playerId).data());
+            }
+            break;
+        }
+        if (record.opcode == static_cast<uint8_t>(Opcode::None)) {
+            if (trace) {
+                printf("%8.3fs %.*s missed the turn deadline\n", elapsedMs / 1000.0,
+                       static_cast<int>(game.name(playerId).size()), game.name(playerId).data());
+            }
+            continue;
+        }
+
+        // Same steps as Room::processInputs
+        const std::string& command = commandNames[record.opcode];
+        result.commands++;
+        if (isAttackCommand(command)) {
+            int eliminated = processAttackCommand(playerId, game, command);
+            if (trace && eliminated >= 0) {
+                printf("%8.3fs %.*s eliminated by %.*s\n", elapsedMs / 1000.0,
+                       static_cast<int>(game.name(eliminated).size()), game.name(eliminated).data(),
+                       static_cast<int>(game.name(playerId).size()), game.name(playerId).data());
+            }
+        } else {
+            game.flags[playerId] |= kPlayerMoved;
+            updatePlayerPosition(playerId, command, game);
+        }
+    }
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <journal> [--trace] [--repeat N]" << std::endl;
+        return 1;
+    }
+    std::string path = argv[1];
+    bool trace = false;
+    long repeat = 1;
+    for (int i = 2; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--trace") trace = true;
+        else if (option == "--repeat" && i + 1 < argc) repeat = std::max(1L, std::atol(argv[++i]));
+    }
+
+    Journal journal;
+    if (!loadJournal(path, journal)) {
+        std::cerr << "Cannot read journal " << path << std::endl;
+        return 1;
+    }
+    for (int opcode = 0; opcode < 256; ++opcode) {
+        commandNames[opcode] = opcodeToText(static_cast<Opcode>(opcode));
+    }
+
+    const GameState& initial = journal.initial;
+    printf("Room %u, %dx%d arena, %d players, %zu records\n", journal.roomId, initial.width, initial.height,
+           initial.playerCount(), journal.records.size());
+
+    GameState game = initial;
+    ReplayResult result = replay(journal, game, trace);
+
+    // Further passes are only for timing, the trace was printed by the first one
+    auto start = std::chrono::steady_clock::now();
+    for (long pass = 1; pass < repeat; ++pass) {
+        game = initial;
+        replay(journal, game, false);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%lu turns, %lu commands\n", static_cast<unsigned long>(result.turns),
+           static_cast<unsigned long>(result.commands));
+    printf("Final positions: %s\n", generatePositions(game).c_str());
+    int survivors = 0, winner = -1;
+    for (int id = 0; id < game.playerCount(); ++id) {
+        if (!game.isEliminated(id)) {
+            survivors++;
+            winner = id;
+        }
+    }
+    if (survivors == 1) {
+        printf("Winner: %.*s\n", static_cast<int>(game.name(winner).size()), game.name(winner).data());
+    } else {
+        printf("%d players still standing\n", survivors);
+    }
+    if (repeat > 1 && seconds > 0) {
+        printf("Replayed %ld times in %.3f s: %.0f turns/s, %.0f commands/s\n", repeat - 1, seconds,
+               result.turns * (repeat - 1) / seconds, result.commands * (repeat - 1) / seconds);
+    }
+    return 0;
+}
@@ -5,33 +5,53 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ctime>
+#include <cstdlib>
 #include <algorithm>
+#include <charconv>
 #include <fcntl.h>
-#include <iomanip>
-#include <sstream>
 #include <chrono>
-
-class Player {
-public:
-    std::string username;
-    char character;
-    int x, y;
-    int colorPair;
-    bool hasMoved = false;
-    std::string lastDirection;
-    bool eliminated = false;
-
-    Player(const std::string& username, char character, int x, int y, int colorPair) :
-            username(username), character(character), x(x), y(y), colorPair(colorPair) {}
-};
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include "protocol.h"
+#include "receive_buffer.h"
+#include "game.h"
+#include "messages.h"
+#include "logger.h"
+#include "journal.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "pool.h"
+#include "outbox.h"
+#include "transport.h"
+#include "uring_transport.h"
+#include "datagram.h"
 
 class ServerNetwork {
 private:
     int server_fd;
+    int datagram_fd = -1; // UDP on the same port, see datagram.h
     struct sockaddr_in address;
     int opt = 1;
 
+    // Datagram sockets share the port: the one every client binds through and one connected to each of them
+    int openDatagramSocket() {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
 public:
     ServerNetwork() {
         address.sin_family = AF_INET;
@@ -44,14 +64,48 @@ public:
 
         socklen_t len = sizeof(address);
         getsockname(server_fd, (struct sockaddr *)&address, &len);
-        listen(server_fd, 3);
+        listen(server_fd, SOMAXCONN);
+
+        datagram_fd = openDatagramSocket();
+        if (datagram_fd < 0) {
+            LOG_WARNING("Cannot open UDP port ", ntohs(address.sin_port), ", clients stay on TCP.");
+        }
 
         std::cout << "Server is running on port " << ntohs(address.sin_port) << std::endl;
     }
 
-    int acceptClient(struct sockaddr_in& client_addr) {
-        socklen_t addrlen = sizeof(client_addr);
-        return accept(server_fd, (struct sockaddr *)&client_addr, &addrlen);
+    // Backend every thread drives its sockets with, from --transport
+    TransportKind transportKind = TransportKind::Epoll;
+
+    int getServerFd() const {
+        return server_fd;
+    }
+
+    // -1 if UDP is not available
+    int getDatagramFd() const {
+        return datagram_fd;
+    }
+
+    // A UDP socket connected to peer, which gets every datagram peer sends from now on. -1 on failure.
+    int connectDatagram(const struct sockaddr_in& peer) {
+        int fd = openDatagramSocket();
+        if (fd >= 0 && connect(fd, (const struct sockaddr *)&peer, sizeof(peer)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // receiveInKernel: the thread keeps its sockets until they close, so the io_uring backend may read them
+    // itself. Falls back to epoll for good if io_uring cannot be set up.
+    std::unique_ptr<Transport> createTransport(bool receiveInKernel, int maxEvents = 64) {
+        if (transportKind == TransportKind::IoUring) {
+            auto transport = std::make_unique<IoUringTransport>(receiveInKernel);
+            if (transport->start()) return transport;
+            LOG_WARNING("io_uring is not available on this kernel, using epoll.");
+            transportKind = TransportKind::Epoll;
+        }
+        return std::make_unique<EpollTransport>(maxEvents);
     }
 
     void setNonBlocking(int socket){
@@ -59,300 +113,1862 @@ public:
         fcntl(socket, F_SETFL, flags | O_NONBLOCK);
     }
 
+    // Turn updates are small and latency bound, do not hold them back to coalesce
+    void setNoDelay(int socket) {
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+
     ~ServerNetwork() {
         close(server_fd);
+        if (datagram_fd >= 0) close(datagram_fd);
     }
 };
 
-std::string getCurrentTimestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto in_time_t = std::chrono::system_clock::to_time_t(now);
-
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X"); // Format: YYYY-MM-DD HH:mm:ss
-    return ss.str();
-}
-
-bool isUsernameOrCharacterTaken(const std::string& username, char character, const std::vector<Player*>& players) {
-    for (const auto& player : players) {
-        if (player->username == username || player->character == character) {
+bool isUsernameOrCharacterTaken(const std::string& username, char character, const GameState& game) {
+    for (int id = 0; id < game.playerCount(); ++id) {
+        if (game.name(id) == username || game.character[id] == character) {
             return true;
         }
     }
     return false;
 }
 
-std::string createPlayerList(const std::vector<Player*>& players) {
-    std::string playerList;
-    for (int i = 0; i < 4; ++i) {
-        if (i < players.size()) {
-            playerList += players[i]->username + ", " + players[i]->character + ";";
-        } else {
-            playerList += "Player " + std::to_string(i + 1) + ";";
-        }
-    }
-    return playerList;
+void logConnection(const std::string& username, char character) {
+    LOG_INFO("New connection: Username = ", username, ", Character = ", character);
 }
 
-void logConnection(const std::string& username, char character) {
-    std::cout << "[" << getCurrentTimestamp() << "] New connection: Username = " << username << ", Character = " << character << std::endl;
+void logDirectionReceived(std::string_view username, std::string_view direction) {
+    LOG_DEBUG("Direction received: Username = ", username, ", Direction = ", direction);
+}
+
+void logPositionUpdate(std::string_view positions) {
+    LOG_DEBUG("Position update: ", positions);
 }
 
-bool isPositionOccupied(int x, int y, const std::vector<Player*>& players) {
-    for (const auto& player : players) {
-        if (!player->eliminated && player->x == x && player->y == y) {
+// Sends right away to a client that is not in a room, room messages go through the connection's Outbox. Counted like
+// those in the metrics.
+ssize_t sendToClient(int socket, const void* data, size_t length, MessageType type) {
+    ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+    MetricsShard& shard = metrics();
+    shard.messagesOut[static_cast<int>(type)].add();
+    if (sent > 0) shard.bytesOut.add(sent);
+    return sent;
+}
+
+// Scratch space for encoding binary frames, one per thread so rooms never share it
+thread_local uint8_t frameScratch[kMaxFrameSize];
+
+// Queued in place of an opcode when a client ends the match
+const uint8_t kShutdownCommand = 0xFF;
+
+// Secret a client proves its UDP bind with, never 0
+uint32_t randomSecret() {
+    uint32_t secret = 0;
+    while (secret == 0) {
+        if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) secret = std::rand();
+    }
+    return secret;
+}
+
+// Secrets sent in DatagramOffer, with the room each one is for. Rooms add them on their worker's thread,
+// the lobby checks a DatagramBind against them before it opens a socket for the client.
+class DatagramOffers {
+private:
+    std::mutex mutex;
+    std::unordered_map<uint32_t, int> offers; // Secret to room id
+
+public:
+    static DatagramOffers& instance() {
+        static DatagramOffers offers;
+        return offers;
+    }
+
+    // False if the secret was already offered to another client
+    bool add(uint32_t secret, int roomId) {
+        std::lock_guard<std::mutex> guard(mutex);
+        return offers.emplace(secret, roomId).second;
+    }
+
+    void remove(uint32_t secret) {
+        std::lock_guard<std::mutex> guard(mutex);
+        offers.erase(secret);
+    }
+
+    bool matches(int roomId, uint32_t secret) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = offers.find(secret);
+        return it != offers.end() && it->second == roomId;
+    }
+};
+
+// A client's UDP path, see datagram.h
+struct DatagramPeer {
+    uint32_t secret = 0;      // Sent with DatagramOffer, 0 until the client asks for UDP
+    int socket = -1;          // Connected to the client once it bound
+    bool confirmed = false;   // The client sent something over UDP since it bound, states go that way
+    bool bindAckDue = false;  // Answers a DatagramBind with the next datagram
+    bool inputAckDue = false;
+    uint32_t nextInput = 1;   // Sequence number of the next command expected
+    SharedMessage* state = nullptr; // Newest state, resent until the client acknowledges it
+    uint32_t stateTurn = 0;
+    bool stateDue = false;    // Goes out with the next flush
+    int resends = 0;
+    std::chrono::steady_clock::time_point stateSentAt;
+    RttEstimator rtt;
+};
+
+// Everything the server keeps about one client socket
+struct Connection {
+    static const int kCommandQueueSize = 8;
+
+    int playerId;
+    Protocol protocol;
+    bool delimited;              // Text clients that end their messages with '|', older ones send them bare
+    bool receivedDirection = false;
+    ReceiveBuffer inbox;         // Bytes read from the socket but not parsed yet
+    uint8_t commands[kCommandQueueSize]; // Parsed commands waiting for their turn
+    int commandHead = 0;
+    int commandCount = 0;
+    uint32_t ackedTurn = 0;      // Newest state the client confirmed, deltas are built against it
+    bool needsKeyframe = true;
+    Outbox outbox;               // Messages waiting for the end of the wakeup
+    DatagramPeer datagram;
+
+    Connection(int playerId, Protocol protocol, bool delimited) :
+            playerId(playerId), protocol(protocol), delimited(delimited) {}
+
+    bool pushCommand(uint8_t command) {
+        if (commandCount == kCommandQueueSize) return false;
+        commands[(commandHead + commandCount++) % kCommandQueueSize] = command;
+        return true;
+    }
+
+    uint8_t popCommand() {
+        uint8_t command = commands[commandHead];
+        commandHead = (commandHead + 1) % kCommandQueueSize;
+        commandCount--;
+        return command;
+    }
+};
+
+// A connection watching a match. It takes no player slot and is only sent the match state: each turn
+// one snapshot shared by every spectator, see Room::publishSnapshot(). A spectator holds the snapshot
+// being written and at most one waiting behind it, a newer one replaces the waiting one, so a slow
+// spectator skips turns instead of queueing them.
+struct Spectator {
+    Protocol protocol;
+    Outbox outbox;
+    SharedMessage* waiting = nullptr;
+
+    explicit Spectator(Protocol protocol) : protocol(protocol) {}
+};
+
+// How the server runs its matches, set from the command line
+struct MatchSettings {
+    int width = 24, height = 10;                  // Arena size in tiles, border included
+    std::vector<std::pair<int, int>> spawnPoints; // One per player slot, see generateSpawnPoints()
+    std::chrono::milliseconds turnTimeout{30000}; // Players who have not moved by then skip the turn, 0 waits forever
+    int tickRate = 0;                             // Turns per second in real-time mode, 0 waits for every player
+    int viewRadius = 0;                           // Binary clients only see players this close, 0 sees everyone (interest.h)
+    std::string journalDirectory;                 // Matches are journaled there when set
+    bool datagrams = false;                       // Clients may ask for UDP mode, see datagram.h
+};
+
+// One match: its players, their sockets and the state of the current turn.
+// A room is only ever touched by the thread that currently owns it, so none of this is locked.
+class Room {
+private:
+    static const size_t kMaxQueuedBytes = 1 << 20; // Backlog of a client that stopped reading before it is cut off
+
+    int id;
+    Transport* transport = nullptr; // Transport of the owning thread
+    GameState game;
+    std::unordered_map<int, Connection> connections; // Maps socket FD to its connection
+    std::unordered_map<int, int> datagramSockets;     // Maps a UDP socket to the socket FD of its connection
+    std::unordered_map<int, Spectator> spectators;    // Maps socket FD to a connection watching the match
+    SharedMessage* snapshots[2] = {};                 // Newest spectator snapshot by Protocol, built on demand
+    uint32_t snapshotTurns[2] = {};
+    int textClients = 0;
+    bool started = false;
+    bool finished = false;
+    uint32_t turn = 0;
+    std::chrono::steady_clock::time_point lastInputTime;
+    std::chrono::steady_clock::time_point turnStartTime; // When the previous turn was resolved
+    std::chrono::steady_clock::time_point matchStartTime;
+    uint64_t tickNumber = 0; // Real-time ticks since the match started, played or skipped
+    std::vector<PositionRecord> history[kSnapshotHistory]; // State after each recent turn, indexed by turn
+    std::vector<PlayerSet> views[kSnapshotHistory];        // Who each player saw after those turns, with a view radius
+    InterestGrid interest;
+    MessagePool messages; // Encoded messages shared by the outboxes, recycled so sending allocates nothing
+
+    MatchSettings settings;                  // The room is full once every spawn point is taken
+    std::unique_ptr<JournalWriter> journal;  // Opened when the match starts
+    TimerWheel<Room>* timers = nullptr;      // Wheel of the owning thread
+    TimerWheel<Room>::Timer turnDeadline{this};
+    TimerWheel<Room>* resendTimers = nullptr; // States not acknowledged over UDP, on threads that play matches
+    TimerWheel<Room>::Timer stateResend{this};
+
+    template <typename... Args>
+    void log(const Args&... args) const {
+        LOG_INFO("[Room ", id, "] ", args...);
+    }
+
+    // Per-turn details, compiled out above LOG_LEVEL_DEBUG
+    template <typename... Args>
+    void logDebug(const Args&... args) const {
+        LOG_DEBUG("[Room ", id, "] ", args...);
+    }
+
+    // Journals an input of the turn being played
+    void journalInput(int playerId, uint8_t opcode, std::chrono::steady_clock::time_point now) {
+        if (journal) {
+            journal->record(turn + 1, playerId, opcode, now);
+        }
+    }
+
+    // Starts the clock on the turn being played: its deadline, or in real-time mode the next tick
+    void armTurnDeadline() {
+        if (!timers || finished) return;
+        if (settings.tickRate > 0) {
+            timers->arm(turnDeadline, tickTime(tickNumber + 1));
+        } else if (settings.turnTimeout.count() > 0) {
+            timers->arm(turnDeadline, std::chrono::steady_clock::now() + settings.turnTimeout);
+        }
+    }
+
+    // Tick times are counted from the start of the match rather than from the previous tick, so a late
+    // wakeup delays one tick and does not push back every tick after it
+    std::chrono::steady_clock::time_point tickTime(uint64_t tick) const {
+        return matchStartTime + std::chrono::nanoseconds(tick * 1000000000 / settings.tickRate);
+    }
+
+    void closeDatagram(DatagramPeer& peer) {
+        if (peer.socket < 0) return;
+        if (transport) {
+            transport->remove(peer.socket);
+        }
+        close(peer.socket);
+        datagramSockets.erase(peer.socket);
+        peer.socket = -1;
+        peer.confirmed = false;
+    }
+
+    void closeSocket(int socket) {
+        if (transport) {
+            transport->remove(socket);
+        }
+        close(socket);
+        auto it = connections.find(socket);
+        if (it->second.protocol == Protocol::Text) {
+            textClients--;
+        }
+        DatagramPeer& peer = it->second.datagram;
+        closeDatagram(peer);
+        if (peer.secret != 0) {
+            DatagramOffers::instance().remove(peer.secret);
+        }
+        if (peer.state) {
+            messages.unref(peer.state);
+        }
+        it->second.outbox.clear(messages);
+        connections.erase(it);
+    }
+
+    void removeSpectator(int socket) {
+        if (transport) {
+            transport->remove(socket);
+        }
+        close(socket);
+        auto it = spectators.find(socket);
+        it->second.outbox.clear(messages);
+        if (it->second.waiting) {
+            messages.unref(it->second.waiting);
+        }
+        spectators.erase(it);
+    }
+
+    // Queues a message for one client, it goes out with the next flushOutput()
+    void queue(Connection& connection, SharedMessage* message) {
+        metrics().messagesOut[static_cast<int>(message->type)].add();
+        connection.outbox.push(messages, message);
+    }
+
+    SharedMessage* copyFrame(MessageType type, const FrameWriter& frame) {
+        SharedMessage* message = messages.create(type);
+        message->bytes.assign(reinterpret_cast<const char*>(frame.data()), frame.length());
+        return message;
+    }
+
+    // Sends an update to every client in the wire format it negotiated, each format is encoded once.
+    // buildText(std::string&) appends the text form, it is only called when someone still speaks it.
+    template <typename TextBuilder>
+    void broadcast(MessageType type, TextBuilder buildText, const FrameWriter& frame) {
+        SharedMessage* binary = copyFrame(type, frame);
+        SharedMessage* text = messages.create(type);
+        if (textClients > 0) {
+            buildText(text->bytes);
+        }
+        for (auto& pair : connections) {
+            queue(pair.second, pair.second.protocol == Protocol::Binary ? binary : text);
+        }
+        messages.unref(binary);
+        messages.unref(text);
+    }
+
+    // Text form of a one character update, e.g. "L<character>|"
+    void broadcastCharacter(MessageType type, char prefix, int playerId, const FrameWriter& frame) {
+        broadcast(type, [&](std::string& text) {
+            text += prefix;
+            text += game.character[playerId];
+            text += '|';
+        }, frame);
+    }
+
+    void broadcastPlayerList() {
+        FrameWriter frame(frameScratch, sizeof(frameScratch));
+        writePlayerList(frame, game, settings.spawnPoints.size());
+        broadcast(MessageType::PlayerList, [&](std::string& text) {
+            text += createPlayerList(game, settings.spawnPoints.size());
+            text += '|';
+        }, frame);
+    }
+
+    // Spectators get it right away as well, with a new snapshot
+    void broadcastElimination(int playerId) {
+        FrameWriter frame(frameScratch, sizeof(frameScratch));
+        frame.begin(MessageType::Eliminated).u8(playerId).end();
+        broadcastCharacter(MessageType::Eliminated, 'E', playerId, frame);
+        releaseSnapshots();
+        publishSnapshot();
+    }
+
+    // Returns false if the queue is full, the client is flooding. A real-time client that fell behind the
+    // ticks answers a backlog of states at once, so in that mode its oldest command is dropped instead.
+    bool queueCommand(Connection& connection, uint8_t command) {
+        if (settings.tickRate > 0 && connection.commandCount == Connection::kCommandQueueSize) {
+            connection.popCommand();
+        }
+        return connection.pushCommand(command);
+    }
+
+    bool queueTextCommand(Connection& connection, std::string_view message) {
+        if (message == "VLPDR_DRTBRT") {
+            metrics().messagesIn[static_cast<int>(MessageType::Shutdown)].add();
+            return queueCommand(connection, kShutdownCommand);
+        }
+        metrics().messagesIn[static_cast<int>(MessageType::Command)].add();
+        Opcode opcode = opcodeFromText(message.data(), message.size());
+        return opcode == Opcode::None || queueCommand(connection, static_cast<uint8_t>(opcode));
+    }
+
+    // Parses every complete message in the inbox. Commands are queued for their turn, acknowledgements
+    // and keyframe requests take effect right away. Returns false if the client overflowed its queue.
+    bool readMessages(Connection& connection) {
+        ReceiveBuffer& inbox = connection.inbox;
+        if (connection.protocol == Protocol::Text) {
+            std::string_view message;
+            if (!connection.delimited) {
+                message = inbox.all();
+                bool queued = message.empty() || queueTextCommand(connection, message);
+                inbox.clear();
+                return queued;
+            }
+            while (inbox.nextDelimited('|', message)) {
+                if (!queueTextCommand(connection, message)) return false;
+                inbox.consume(message.size() + 1);
+            }
             return true;
         }
+
+        Frame frame;
+        while (inbox.nextFrame(frame)) {
+            if (!handleFrame(connection, frame, false)) return false;
+            inbox.consume(frame.totalSize);
+        }
+        return true;
     }
-    return false;
-}
 
-void updatePlayerPosition(Player* player, const std::string& command, const std::vector<Player*>& players) {
-    if (command.empty()) return;
+    // Handles a binary frame from the TCP stream or, if overDatagram, from a datagram. Returns false if
+    // the client overflowed its command queue.
+    bool handleFrame(Connection& connection, const Frame& frame, bool overDatagram) {
+        PayloadReader reader(frame);
+        DatagramPeer& peer = connection.datagram;
+        if (static_cast<int>(frame.type) < kMessageTypes) {
+            metrics().messagesIn[static_cast<int>(frame.type)].add();
+        }
+        switch (frame.type) {
+            case MessageType::Command: {
+                uint8_t opcode = reader.u8();
+                if (overDatagram || !reader.good() || !isCommandOpcode(opcode)) break;
+                if (!queueCommand(connection, opcode)) return false;
+                break;
+            }
+            case MessageType::Shutdown:
+                if (!overDatagram && !queueCommand(connection, kShutdownCommand)) return false;
+                break;
+            case MessageType::Ack: {
+                uint32_t acked = reader.u32();
+                if (!reader.good() || acked > turn) break;
+                if (acked > connection.ackedTurn) {
+                    connection.ackedTurn = acked;
+                }
+                if (peer.state && acked >= peer.stateTurn) {
+                    if (peer.resends == 0 && !peer.stateDue) {
+                        peer.rtt.sample(std::chrono::steady_clock::now() - peer.stateSentAt);
+                    }
+                    messages.unref(peer.state);
+                    peer.state = nullptr;
+                    peer.stateDue = false;
+                }
+                break;
+            }
+            case MessageType::KeyframeRequest:
+                sendKeyframe(connection);
+                break;
+            case MessageType::DatagramOpen:
+                if (!overDatagram) offerDatagrams(connection);
+                break;
+            case MessageType::DatagramBind:
+                if (overDatagram) peer.bindAckDue = true; // The client did not get the answer to its bind yet
+                return true;
+            case MessageType::Inputs:
+                if (!acceptInputs(connection, reader)) return false;
+                break;
+            default:
+                break;
+        }
+        if (overDatagram) {
+            peer.confirmed = true;
+        }
+        return true;
+    }
 
-    char direction = command[0];
+    // Queues the commands of an Inputs frame that were not queued before, the client repeats them until
+    // they are acknowledged. A gap in the sequence numbers is commands the client gave up on, an opcode
+    // that is not a command is skipped but still acknowledged.
+    bool acceptInputs(Connection& connection, PayloadReader& reader) {
+        DatagramPeer& peer = connection.datagram;
+        uint32_t sequence = reader.u32();
+        uint8_t count = reader.u8();
+        const uint8_t* opcodes = reader.bytes(count);
+        if (!reader.good()) return true;
+        for (int i = 0; i < count; ++i, ++sequence) {
+            if (static_cast<int32_t>(sequence - peer.nextInput) < 0) continue;
+            if (isCommandOpcode(opcodes[i]) && !queueCommand(connection, opcodes[i])) return false;
+            peer.nextInput = sequence + 1;
+        }
+        peer.inputAckDue = true;
+        return true;
+    }
 
-    int newX = player->x, newY = player->y;
+    void offerDatagrams(Connection& connection) {
+        DatagramPeer& peer = connection.datagram;
+        if (!settings.datagrams || peer.secret != 0) return;
+        do {
+            peer.secret = randomSecret();
+        } while (!DatagramOffers::instance().add(peer.secret, id));
+        FrameWriter frame(frameScratch, sizeof(frameScratch));
+        frame.begin(MessageType::DatagramOffer).u32(id).u32(peer.secret).end();
+        SharedMessage* offer = copyFrame(MessageType::DatagramOffer, frame);
+        queue(connection, offer);
+        messages.unref(offer);
+    }
 
-    if (direction == 'U') newY -= 1;
-    else if (direction == 'D') newY += 1;
-    else if (direction == 'L') newX -= 1;
-    else if (direction == 'R') newX += 1;
+    // Reads a datagram from the client's UDP socket, which holds whole frames. Anything malformed is
+    // dropped, like a datagram the network lost.
+    bool readDatagram(Connection& connection, const uint8_t* data, size_t size) {
+        metrics().bytesIn.add(size);
+        Frame frame;
+        while (peekFrame(data, size, frame)) {
+            if (!handleFrame(connection, frame, true)) return false;
+            data += frame.totalSize;
+            size -= frame.totalSize;
+        }
+        return true;
+    }
 
-    // Boundary checks
-    if (newX > 1 && newX < 24 && newY > 1 && newY < 10 && !isPositionOccupied(newX, newY, players)) {
-        player->x = newX;
-        player->y = newY;
+    void onDatagramEvent(const TransportEvent& event, int socket) {
+        Connection& connection = connections.at(socket);
+        bool handled = true;
+        if (event.type == TransportEvent::Type::Readable) {
+            uint8_t buffer[kDatagramBufferSize];
+            while (handled) {
+                ssize_t size = recv(event.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (size < 0 && (errno == EINTR || errno == ECONNREFUSED)) continue;
+                if (size < 0) break;
+                handled = readDatagram(connection, buffer, size);
+            }
+        } else if (event.type == TransportEvent::Type::Received) {
+            handled = readDatagram(connection, event.data, event.size);
+        } else if (event.type == TransportEvent::Type::Closed) {
+            // An ICMP error or an empty datagram ended the receive, the client is still there
+            transport->remove(event.fd);
+            transport->add(event.fd);
+        }
+        if (!handled) {
+            disconnect(socket);
+        }
     }
 
-    // Log updated position
-//    std::time_t now = std::time(0);
-//    std::tm* ltm = std::localtime(&now);
-//    std::cout << "[" << 1 + ltm->tm_hour << ":" << 1 + ltm->tm_min << ":" << 1 + ltm->tm_sec
-//              << "] Player position updated: " << player->username
-//              << " (" << player->x << ", " << player->y << ")" << std::endl;
-}
+    // Clients heard from over UDP get states there, newest wins: one that has not gone out or been
+    // acknowledged yet is replaced. States too big for a datagram go over TCP.
+    void sendState(Connection& connection, SharedMessage* message) {
+        DatagramPeer& peer = connection.datagram;
+        if (!peer.confirmed || message->bytes.size() > kMaxDatagramSize) {
+            queue(connection, message);
+            return;
+        }
+        metrics().messagesOut[static_cast<int>(message->type)].add();
+        messages.ref(message);
+        if (peer.state) {
+            messages.unref(peer.state);
+        }
+        peer.state = message;
+        peer.stateTurn = turn;
+        peer.stateDue = true;
+        peer.resends = 0;
+    }
 
-std::string receiveData(int socket) {
-    char buffer[1024] = {0};
-    ssize_t bytes_read = read(socket, buffer, 1024);
-    if (bytes_read > 0) {
-        return std::string(buffer, bytes_read);
+    // Sends what is due over UDP in a single datagram: the answer to a bind, the input acknowledgement
+    // and the newest state. A full socket buffer drops it like the network would, resends cover that.
+    // Input acknowledgements go over TCP to a client not heard from over UDP.
+    void flushDatagram(Connection& connection, std::chrono::steady_clock::time_point now) {
+        DatagramPeer& peer = connection.datagram;
+        MetricsShard& shard = metrics();
+        uint8_t header[2 * (kFrameHeaderSize + 8)];
+        FrameWriter frame(header, sizeof(header));
+        if (peer.inputAckDue && !peer.confirmed) {
+            frame.begin(MessageType::InputAck).u32(peer.nextInput).end();
+            SharedMessage* ack = copyFrame(MessageType::InputAck, frame);
+            queue(connection, ack);
+            messages.unref(ack);
+            frame.clear();
+            peer.inputAckDue = false;
+        }
+        if (peer.socket < 0) return;
+
+        if (peer.bindAckDue) {
+            frame.begin(MessageType::DatagramBind).u32(id).u32(peer.secret).end();
+            shard.messagesOut[static_cast<int>(MessageType::DatagramBind)].add();
+        }
+        if (peer.inputAckDue) {
+            frame.begin(MessageType::InputAck).u32(peer.nextInput).end();
+            shard.messagesOut[static_cast<int>(MessageType::InputAck)].add();
+        }
+        if (frame.length() == 0 && !peer.stateDue) return;
+
+        struct iovec segments[2] = {{header, frame.length()}, {}};
+        struct msghdr message = {};
+        message.msg_iov = segments;
+        message.msg_iovlen = 1;
+        if (peer.stateDue) {
+            segments[1] = {const_cast<char*>(peer.state->bytes.data()), peer.state->bytes.size()};
+            message.msg_iovlen = 2;
+            peer.stateSentAt = now;
+        }
+        ssize_t sent = sendmsg(peer.socket, &message, MSG_DONTWAIT);
+        if (sent > 0) shard.bytesOut.add(sent);
+        peer.bindAckDue = peer.inputAckDue = peer.stateDue = false;
     }
-    return ""; // Return an empty string if no data is received
-}
 
-std::string createMoveStatus(const std::vector<Player*>& players) {
-    std::string status;
-    for (const auto& player : players) {
-        status += player->username + "," + player->character + ",";
-        status += player->hasMoved ? "1" : "0";
-        status += ";";
+    // Arms the resend timer for the first state that will be overdue
+    void scheduleResend() {
+        if (!resendTimers) return;
+        bool pending = false;
+        std::chrono::steady_clock::time_point earliest;
+        for (const auto& pair : connections) {
+            const DatagramPeer& peer = pair.second.datagram;
+            if (!peer.state) continue;
+            auto due = peer.stateSentAt + peer.rtt.resendTimeout(peer.resends);
+            if (!pending || due < earliest) earliest = due;
+            pending = true;
+        }
+        if (pending) {
+            resendTimers->arm(stateResend, earliest);
+        } else {
+            stateResend.cancel();
+        }
     }
-    return status;
-}
 
-bool isAttackCommand(const std::string& command) {
-    // Check if the command is one of the attack commands
-    std::string attackCommands = "ETFYFHCGBCetfyfhcgbc";
-    return attackCommands.find(command) != std::string::npos;
-}
+    void sendKeyframe(Connection& connection) {
+        if (turn == 0) {
+            connection.needsKeyframe = true; // Nothing to show yet, the first turn will carry one
+            return;
+        }
+        FrameWriter frame(frameScratch, sizeof(frameScratch));
+        const std::vector<PositionRecord>& records = history[turn % kSnapshotHistory];
+        if (settings.viewRadius > 0) {
+            writePositions(frame, turn, records, views[turn % kSnapshotHistory][connection.playerId]);
+        } else {
+            writePositions(frame, turn, records);
+        }
+        SharedMessage* keyframe = copyFrame(MessageType::Positions, frame);
+        sendState(connection, keyframe);
+        messages.unref(keyframe);
+    }
+
+    bool hasQueuedCommands() const {
+        for (const auto& pair : connections) {
+            if (pair.second.commandCount > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Works out who every binary client sees after this turn, only called with a view radius
+    void updateViews() {
+        std::vector<PlayerSet>& visible = views[turn % kSnapshotHistory];
+        interest.rebuild(game);
+        for (auto& pair : connections) {
+            if (pair.second.protocol != Protocol::Binary) continue;
+            int playerId = pair.second.playerId;
+            interest.query(game, game.x[playerId], game.y[playerId], visible[playerId]);
+        }
+    }
+
+    // With a view radius no two clients see the same, each gets a frame of its own
+    void sendView(Connection& connection, uint32_t baseTurn, const std::vector<PositionRecord>& records) {
+        const PlayerSet& visible = views[turn % kSnapshotHistory][connection.playerId];
+        FrameWriter writer(frameScratch, sizeof(frameScratch));
+        if (baseTurn == 0) {
+            writePositions(writer, turn, records, visible);
+        } else {
+            writeDelta(writer, turn, baseTurn, history[baseTurn % kSnapshotHistory],
+                       views[baseTurn % kSnapshotHistory][connection.playerId], records, visible);
+        }
+        SharedMessage* frame = copyFrame(baseTurn == 0 ? MessageType::Positions : MessageType::Delta, writer);
+        sendState(connection, frame);
+        messages.unref(frame);
+    }
 
-void processAttackCommand(Player* attacker, const std::vector<Player*>& players, const std::string& command, const std::unordered_map<int, Player*>& socketToPlayerMap) {
-    std::cout << "[" << getCurrentTimestamp() << "] Attack command received from " << attacker->username << ": " << command << std::endl;
-    int attackX = attacker->x, attackY = attacker->y;
+    // Sends the new state to binary clients as a delta against the state each one acknowledged,
+    // or as a keyframe when that state is unknown or too old. Each distinct frame is encoded once.
+    void broadcastState(const std::vector<PositionRecord>& records) {
+        static const int kMaxDeltaBases = 4;
+        struct Encoded {
+            uint32_t baseTurn;
+            SharedMessage* message;
+        };
+        Encoded deltas[kMaxDeltaBases];
+        int deltaCount = 0;
+        SharedMessage* keyframe = nullptr; // Kept apart from the deltas, so a full table always has room for it
 
-    if (command == "e" || command == "E") { attackX--; attackY--; } // Attack top left
-    else if (command == "t" || command == "T") { attackY--; } // Attack top
-    else if (command == "y" || command == "Y") { attackX++; attackY--; } // Attack top right
-    else if (command == "f" || command == "F") { attackX--; } // Attack left
-    else if (command == "h" || command == "H") { attackX++; } // Attack right
-    else if (command == "c" || command == "C") { attackX--; attackY++; } // Attack bottom left
-    else if (command == "g" || command == "G") { attackY++; } // Attack bottom
-    else if (command == "b" || command == "B") { attackX++; attackY++; } // Attack bottom right
+        for (auto& pair : connections) {
+            Connection& connection = pair.second;
+            if (connection.protocol != Protocol::Binary) continue;
 
-    for (auto& target : players) {
-        if (target != attacker && !target->eliminated && target->x == attackX && target->y == attackY) {
-            target->eliminated = true; // Eliminate the target
-            std::cout << "[" << getCurrentTimestamp() << "] Player " << target->username << " eliminated by " << attacker->username << std::endl;
-            // Send update to all clients about the elimination
-            std::string eliminationUpdate = "E" + std::string(1, target->character) + "|";
-            for (const auto& pair : socketToPlayerMap) {
-                send(pair.first, eliminationUpdate.c_str(), eliminationUpdate.length(), 0);
+            uint32_t baseTurn = connection.needsKeyframe ? 0 : connection.ackedTurn;
+            if (baseTurn == 0 || turn - baseTurn >= kSnapshotHistory) {
+                baseTurn = 0;
+            }
+            connection.needsKeyframe = false;
+            if (settings.viewRadius > 0) {
+                sendView(connection, baseTurn, records);
+                continue;
+            }
+
+            SharedMessage* message = nullptr;
+            if (baseTurn != 0) {
+                for (int i = 0; i < deltaCount; ++i) {
+                    if (deltas[i].baseTurn == baseTurn) message = deltas[i].message;
+                }
+                // Clients spread over more bases than that get the shared keyframe instead
+                if (!message && deltaCount < kMaxDeltaBases) {
+                    FrameWriter writer(frameScratch, sizeof(frameScratch));
+                    writeDelta(writer, turn, baseTurn, history[baseTurn % kSnapshotHistory], records);
+                    message = copyFrame(MessageType::Delta, writer);
+                    deltas[deltaCount++] = {baseTurn, message};
+                }
             }
-            break; // Only eliminate one player per attack
+            if (!message) {
+                if (!keyframe) {
+                    FrameWriter writer(frameScratch, sizeof(frameScratch));
+                    writePositions(writer, turn, records);
+                    keyframe = copyFrame(MessageType::Positions, writer);
+                }
+                message = keyframe;
+            }
+
+            sendState(connection, message);
+        }
+        for (int i = 0; i < deltaCount; ++i) {
+            messages.unref(deltas[i].message);
+        }
+        if (keyframe) {
+            messages.unref(keyframe);
         }
     }
-}
 
-std::string generateMoveStatus(const std::vector<Player*>& players) {
-    std::string moveStatus;
-    for (const auto& player : players) {
-        moveStatus += player->username + "," + player->character + "," + (player->hasMoved ? "1" : "0") + ";";
+    void releaseSnapshots() {
+        for (SharedMessage*& snapshot : snapshots) {
+            if (snapshot) messages.unref(snapshot);
+            snapshot = nullptr;
+        }
     }
-    return moveStatus;
-}
 
-std::string generatePositions(const std::vector<Player*>& players) {
-    std::string positions;
-    for (const auto& player : players) {
-        if (player->eliminated) {
-            positions += player->character + std::string("X;"); // Indicate elimination
+    // The state as spectators get it: the positions of the last turn, then every elimination so far, so
+    // any one snapshot shows the whole match and a skipped one is not missed. Encoded once per turn (and
+    // elimination) and wire format however many spectators there are.
+    SharedMessage* snapshotFor(Protocol protocol) {
+        int index = static_cast<int>(protocol);
+        if (snapshots[index] && snapshotTurns[index] == turn) {
+            return snapshots[index];
+        }
+        if (snapshots[index]) {
+            messages.unref(snapshots[index]);
+        }
+        const std::vector<PositionRecord>& records = history[turn % kSnapshotHistory];
+        SharedMessage* snapshot = messages.create(MessageType::Positions);
+        if (protocol == Protocol::Binary) {
+            FrameWriter frame(frameScratch, sizeof(frameScratch));
+            writePositions(frame, turn, records);
+            for (int playerId = 0; playerId < game.playerCount(); ++playerId) {
+                if (game.isEliminated(playerId)) {
+                    frame.begin(MessageType::Eliminated).u8(playerId).end();
+                }
+            }
+            snapshot->bytes.assign(reinterpret_cast<const char*>(frame.data()), frame.length());
         } else {
-            positions += std::to_string(player->x) + "," + std::to_string(player->y)
-                         + "," + player->character + "," + std::to_string(player->colorPair) + ";";
+            snapshot->bytes += "R|P";
+            appendPositions(snapshot->bytes, game, records);
+            snapshot->bytes += '|';
+            for (int playerId = 0; playerId < game.playerCount(); ++playerId) {
+                if (game.isEliminated(playerId)) {
+                    snapshot->bytes += 'E';
+                    snapshot->bytes += game.character[playerId];
+                    snapshot->bytes += '|';
+                }
+            }
         }
+        snapshots[index] = snapshot;
+        snapshotTurns[index] = turn;
+        return snapshot;
     }
-    return positions;
-}
 
-void logDirectionReceived(const std::string& username, const std::string& direction) {
-    std::cout << "[" << getCurrentTimestamp() << "] Direction received: Username = " << username << ", Direction = " << direction << std::endl;
-}
+    // Hands the newest state to every spectator, it replaces one a slow spectator has not started on
+    void publishSnapshot() {
+        for (auto& pair : spectators) {
+            Spectator& spectator = pair.second;
+            SharedMessage* snapshot = snapshotFor(spectator.protocol);
+            if (spectator.waiting) {
+                messages.unref(spectator.waiting);
+                metrics().skippedSnapshots.add();
+            }
+            messages.ref(snapshot);
+            spectator.waiting = snapshot;
+        }
+    }
 
-void logPositionUpdate(const std::string& positions) {
-    std::cout << "[" << getCurrentTimestamp() << "] Position update: " << positions << std::endl;
-}
+    // The players and arena size go first, in the format of the match start, then the newest state
+    void introduceSpectator(Spectator& spectator) {
+        SharedMessage* players = messages.create(MessageType::PlayerList);
+        if (spectator.protocol == Protocol::Binary) {
+            FrameWriter frame(frameScratch, sizeof(frameScratch));
+            writePlayerList(frame, game, settings.spawnPoints.size());
+            players->bytes.assign(reinterpret_cast<const char*>(frame.data()), frame.length());
+        } else {
+            players->bytes = createPlayerList(game, settings.spawnPoints.size()) + "|A" +
+                             std::to_string(game.width) + "," + std::to_string(game.height) + "|";
+        }
+        metrics().messagesOut[static_cast<int>(MessageType::PlayerList)].add();
+        spectator.outbox.push(messages, players);
+        messages.unref(players);
 
-int main() {
-    ServerNetwork serverNetwork;
-    std::vector<Player*> players;
-    std::unordered_map<int, Player*> socketToPlayerMap; // Maps socket FD to player
-    std::unordered_map<int, bool> receivedDirections;   // Tracks whether a direction has been received
+        SharedMessage* snapshot = snapshotFor(spectator.protocol);
+        messages.ref(snapshot);
+        spectator.waiting = snapshot;
+    }
+
+    // Spectators have nothing to say, whatever they send is read and dropped
+    void onSpectatorEvent(const TransportEvent& event) {
+        if (event.type == TransportEvent::Type::Writable) {
+            return;
+        }
+        if (event.type == TransportEvent::Type::Received) {
+            metrics().bytesIn.add(event.size);
+            return;
+        }
+        if (event.type == TransportEvent::Type::Readable) {
+            uint8_t discard[512];
+            while (true) {
+                ssize_t size = recv(event.fd, discard, sizeof(discard), MSG_DONTWAIT);
+                if (size > 0) {
+                    metrics().bytesIn.add(size);
+                    continue;
+                }
+                if (size < 0 && errno == EINTR) continue;
+                if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+                break;
+            }
+        }
+        removeSpectator(event.fd);
+    }
+
+    // A player leaving the lobby frees the slot, the others move up to keep spawn points and colors in order
+    void removeLobbyPlayer(int socket) {
+        int playerId = connections.at(socket).playerId;
+        closeSocket(socket);
+        log("Player ", game.name(playerId), " left the lobby.");
+        game.removePlayer(playerId);
 
-    // Positions for players (top-left, top-right, bottom-left, bottom-right)
-    std::vector<std::pair<int, int>> startingPositions = {{2, 2}, {23, 2}, {2, 9}, {23, 9}};
-    int movedPlayersCount = 0;
+        for (auto& pair : connections) {
+            if (pair.second.playerId > playerId) pair.second.playerId--;
+        }
+        for (int i = 0; i < game.playerCount(); ++i) {
+            game.x[i] = settings.spawnPoints[i].first;
+            game.y[i] = settings.spawnPoints[i].second;
+            game.colorPair[i] = colorForSlot(i);
+        }
+        game.rebuildGrid();
+        broadcastPlayerList();
+    }
 
-    while (players.size() < 4) {
-        struct sockaddr_in client_addr;
-        int new_socket = serverNetwork.acceptClient(client_addr);
+    // Removes a player whose connection dropped so the remaining players are not left waiting for it
+    void dropPlayer(int socket) {
+        int playerId = connections.at(socket).playerId;
+        closeSocket(socket);
 
-        if (new_socket < 0) {
-            continue;
+        log("Player ", game.name(playerId), " disconnected.");
+        if (!game.isEliminated(playerId)) {
+            journalInput(playerId, kJournalDisconnect, std::chrono::steady_clock::now());
+            game.eliminatePlayer(playerId);
+            broadcastElimination(playerId);
         }
+        if (connections.empty()) {
+            log("All players left.");
+            finished = true;
+        }
+    }
 
-        char buffer[1024] = {0};
-        ssize_t bytes_read = read(new_socket, buffer, 1024);
-        if (bytes_read <= 0) {
-            close(new_socket);
-            continue;
+    // timed: a timer ended the turn (its deadline or a real-time tick) rather than an input completing it
+    void resolveTurn(bool timed = false) {
+        auto resolveStart = std::chrono::steady_clock::now();
+        std::vector<PositionRecord>& records = history[++turn % kSnapshotHistory];
+        records.clear();
+        for (int playerId = 0; playerId < game.playerCount(); ++playerId) {
+            records.push_back(makePositionRecord(game, playerId));
+        }
+        if (settings.viewRadius > 0) {
+            updateViews();
         }
 
-        std::string data(buffer);
-        size_t commaPos = data.find(',');
-        std::string username = data.substr(0, commaPos);
-        char character = data[commaPos + 1];
+        // Prepare 'R|P' command with positions, only needed for text clients and the trace log
+        SharedMessage* text = messages.create(MessageType::Positions);
+        if (textClients > 0 || LOG_LEVEL <= LOG_LEVEL_DEBUG) {
+            std::string& outgoingText = text->bytes;
+            outgoingText += "R|P";
+            appendPositions(outgoingText, game);
+            outgoingText += '|';
 
-        if (isUsernameOrCharacterTaken(username, character, players)) {
-            std::string response = "taken";
-            send(new_socket, response.c_str(), response.length(), 0);
-            close(new_socket);
-            continue;
+            // Log the position update
+            logPositionUpdate(std::string_view(outgoingText).substr(3, outgoingText.size() - 4));
+            LOG_DEBUG("Sending position update to clients: ", outgoingText);
         }
 
-        logConnection(username, character);  // Log new connection
+        // Send reset and positions command to text clients, binary ones get a delta or keyframe
+        for (auto& pair : connections) {
+            if (pair.second.protocol == Protocol::Text) {
+                queue(pair.second, text);
+            }
+        }
+        messages.unref(text);
+        broadcastState(records);
+        publishSnapshot();
 
-        Player* newPlayer = new Player(username, character,
-                                       startingPositions[players.size()].first,
-                                       startingPositions[players.size()].second,
-                                       players.size() + 1);
-        players.push_back(newPlayer);
-        socketToPlayerMap[new_socket] = newPlayer;
-        receivedDirections[new_socket] = false;
+        auto sent = std::chrono::steady_clock::now();
+        MetricsShard& shard = metrics();
+        shard.turns.add();
+        shard.broadcastTime.record(sent - resolveStart);
+        shard.turnDuration.record(sent - turnStartTime);
+        if (!timed) {
+            shard.inputLatency.record(sent - lastInputTime);
+        }
+        turnStartTime = sent;
 
-        std::string playerList = createPlayerList(players);
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(sent - lastInputTime);
+        logDebug("Turn ", turn, " resolved ", latency.count(), " us after the last input.");
+        if (journal) {
+            journal->turnEnd(turn, std::chrono::steady_clock::now());
+        }
 
-        for (const auto& pair : socketToPlayerMap) {
-            send(pair.first, playerList.c_str(), playerList.length(), 0);
+        // Reset the directions and move status
+        game.clearMoves();
+        for(auto& pair : connections) {
+            pair.second.receivedDirection = false;
         }
+        armTurnDeadline();
+    }
 
-        serverNetwork.setNonBlocking(new_socket);
+public:
+    // The client has four player colors, larger matches reuse them
+    static int colorForSlot(int slot) {
+        return slot % 4 + 1;
     }
 
-    // Inside the server main loop
-    while (true) {
-        bool allDirectionsReceived = true;
+    Room(int id, const MatchSettings& settings) :
+            id(id), game(settings.width, settings.height), settings(settings) {}
 
-        for (auto& pair : socketToPlayerMap) {
-            int socket = pair.first;
-            Player* player = pair.second;
+    int getId() const {
+        return id;
+    }
 
-            if (!receivedDirections[socket] && !player->eliminated) {
-                std::string command = receiveData(socket);
-                if (command == "VLPDR_DRTBRT"){
-                    std::cout << "[" << getCurrentTimestamp() << "] Server shutdown initiated." << std::endl;
-                    // Close all client sockets
-                    for (const auto& pair : socketToPlayerMap) {
-                        close(pair.first);
-                    }
+    bool isFull() const {
+        return game.playerCount() >= static_cast<int>(settings.spawnPoints.size());
+    }
 
-                    // Release all dynamically allocated Player objects
-                    for (Player* player : players) {
-                        delete player;
-                    }
+    bool isFinished() const {
+        return finished;
+    }
 
-                    // Log completion of cleanup
-                    std::cout << "[" << getCurrentTimestamp() << "] Server resources cleaned up. Shutting down." << std::endl;
+    // TCP and UDP, players and spectators, every socket whose events go to this room
+    std::vector<int> getSockets() const {
+        std::vector<int> sockets;
+        for (const auto& pair : connections) {
+            sockets.push_back(pair.first);
+        }
+        for (const auto& pair : datagramSockets) {
+            sockets.push_back(pair.first);
+        }
+        for (const auto& pair : spectators) {
+            sockets.push_back(pair.first);
+        }
+        return sockets;
+    }
 
-                    return 0;
-                }
-                if (!command.empty()) {
-                    if (isAttackCommand(command)) {
-                        processAttackCommand(player, players, command, socketToPlayerMap);
-                        receivedDirections[socket] = true;
+    // Hands the room's sockets to the transport of the thread that takes ownership of it. Turn deadlines
+    // and state resends only run on threads that pass timer wheels for them.
+    void attach(Transport& newTransport, TimerWheel<Room>* newTimers = nullptr, TimerWheel<Room>* newResendTimers = nullptr) {
+        transport = &newTransport;
+        timers = newTimers;
+        resendTimers = newResendTimers;
+        for (int socket : getSockets()) {
+            transport->add(socket);
+        }
+    }
+
+    void detach() {
+        for (int socket : getSockets()) {
+            transport->remove(socket);
+        }
+        transport = nullptr;
+        turnDeadline.cancel();
+        timers = nullptr;
+        stateResend.cancel();
+        resendTimers = nullptr;
+    }
+
+    // Takes the UDP socket the lobby connected to the client that sent DatagramBind with this secret.
+    // Returns whether the room kept it, the caller closes it otherwise.
+    bool bindDatagram(uint32_t secret, int socket) {
+        for (auto& pair : connections) {
+            DatagramPeer& peer = pair.second.datagram;
+            if (secret == 0 || peer.secret != secret) continue;
+            peer.bindAckDue = true;
+            if (peer.socket >= 0) return false; // A resent bind overtook the answer to the first one
+            peer.socket = socket;
+            datagramSockets[socket] = pair.first;
+            if (transport) {
+                transport->add(socket);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Takes a connection that asked to watch this match. It is sent the players once the match has
+    // started, then every turn's state.
+    void addSpectator(int socket, Protocol protocol) {
+        Spectator& spectator = spectators.emplace(socket, protocol).first->second;
+        if (transport) {
+            transport->add(socket);
+        }
+        metrics().spectators.add();
+        if (started) {
+            introduceSpectator(spectator);
+        }
+    }
+
+    // pending holds whatever the client sent after its handshake
+    bool addPlayer(int socket, const std::string& username, char character, Protocol protocol, bool delimited,
+                   const uint8_t* pending, size_t pendingSize) {
+        if (isUsernameOrCharacterTaken(username, character, game)) {
+            return false;
+        }
+
+        int slot = game.playerCount();
+        int playerId = game.addPlayer(username, character, settings.spawnPoints[slot].first,
+                                      settings.spawnPoints[slot].second, colorForSlot(slot));
+        Connection& connection = connections.emplace(std::piecewise_construct, std::forward_as_tuple(socket),
+                                                     std::forward_as_tuple(playerId, protocol, delimited)).first->second;
+        connection.inbox.append(pending, pendingSize);
+        readMessages(connection);
+        if (protocol == Protocol::Text) {
+            textClients++;
+        }
+        if (transport) {
+            transport->add(socket); // The lobby already watched it during the handshake, this keeps it
+        }
+
+        broadcastPlayerList();
+        return true;
+    }
+
+    void start() {
+        // Binary clients got the arena size with the player list, text clients that delimit their messages
+        // get it now. Older text clients always draw the default 24x10 arena.
+        SharedMessage* arenaSize = messages.create(MessageType::PlayerList);
+        arenaSize->bytes = "A" + std::to_string(game.width) + "," + std::to_string(game.height) + "|";
+        for (auto& pair : connections) {
+            if (pair.second.protocol == Protocol::Text && pair.second.delimited) {
+                // Binary clients get the arena size with the player list
+                queue(pair.second, arenaSize);
+            }
+        }
+        messages.unref(arenaSize);
+
+        // Sized once, so turns never grow them. Turn 0 is the spawn points, what spectators see first.
+        for (auto& records : history) {
+            records.reserve(game.playerCount());
+        }
+        for (int playerId = 0; playerId < game.playerCount(); ++playerId) {
+            history[0].push_back(makePositionRecord(game, playerId));
+        }
+        if (settings.viewRadius > 0) {
+            interest.reset(game.width, game.height, settings.viewRadius, game.playerCount());
+            for (auto& visible : views) {
+                visible.resize(game.playerCount());
+            }
+        }
+
+        started = true;
+        lastInputTime = std::chrono::steady_clock::now();
+        turnStartTime = lastInputTime;
+        matchStartTime = lastInputTime;
+        log("Match started.");
+        armTurnDeadline();
+        for (auto& pair : spectators) {
+            introduceSpectator(pair.second);
+        }
+
+        if (!settings.journalDirectory.empty()) {
+            std::string path = settings.journalDirectory + "/room-" + std::to_string(id) + ".journal";
+            journal = std::make_unique<JournalWriter>();
+            if (!journal->open(path, id, game, lastInputTime)) {
+                LOG_WARNING("[Room ", id, "] Cannot write the journal to ", path, ".");
+                journal.reset();
+            }
+        }
+    }
+
+    void disconnect(int socket) {
+        if (started) {
+            dropPlayer(socket);
+        } else {
+            removeLobbyPlayer(socket);
+        }
+    }
+
+    // Writability needs nothing here, whatever is queued goes out with the next flushOutput()
+    void onEvent(const TransportEvent& event) {
+        auto datagram = datagramSockets.find(event.fd);
+        if (datagram != datagramSockets.end()) {
+            onDatagramEvent(event, datagram->second);
+            return;
+        }
+        if (spectators.count(event.fd)) {
+            onSpectatorEvent(event);
+            return;
+        }
+        auto it = connections.find(event.fd);
+        if (it == connections.end() || event.type == TransportEvent::Type::Writable) {
+            return;
+        }
+
+        // A well-behaved client has at most a couple of commands in flight, a full buffer or queue means flooding
+        Connection& connection = it->second;
+        if (event.type == TransportEvent::Type::Readable) {
+            size_t buffered = connection.inbox.size();
+            ReceiveBuffer::ReadStatus status = connection.inbox.readFrom(event.fd);
+            metrics().bytesIn.add(connection.inbox.size() - buffered);
+            if (status == ReceiveBuffer::ReadStatus::Drained && readMessages(connection)) {
+                return;
+            }
+        } else if (event.type == TransportEvent::Type::Received) {
+            metrics().bytesIn.add(event.size);
+            if (connection.inbox.append(event.data, event.size) && readMessages(connection)) {
+                return;
+            }
+        }
+        disconnect(event.fd);
+    }
+
+    // Hands everything queued since the last call to the transport, one write per client. What a full
+    // socket buffer does not take stays queued until the socket drains. A client whose backlog keeps
+    // growing is shut down, the transport then reports it and it is dropped like any other disconnect.
+    // Datagrams go out right away, see flushDatagram(). Spectators get the newest snapshot once they took the last one.
+    void flushOutput() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& pair : connections) {
+            flushDatagram(pair.second, now);
+            Outbox& outbox = pair.second.outbox;
+            if (outbox.empty()) continue;
+            if (outbox.size() > kMaxQueuedBytes) {
+                log("Player ", game.name(pair.second.playerId), " stopped reading, disconnecting.");
+                outbox.clear(messages);
+                shutdown(pair.first, SHUT_RDWR);
+                continue;
+            }
+            transport->send(pair.first, outbox, messages);
+        }
+        for (auto& pair : spectators) {
+            Spectator& spectator = pair.second;
+            if (spectator.outbox.empty() && spectator.waiting) {
+                metrics().messagesOut[static_cast<int>(MessageType::Positions)].add();
+                spectator.outbox.push(messages, spectator.waiting);
+                messages.unref(spectator.waiting);
+                spectator.waiting = nullptr;
+            }
+            if (!spectator.outbox.empty()) {
+                transport->send(pair.first, spectator.outbox, messages);
+            }
+        }
+        scheduleResend();
+    }
+
+    // The resend timer fired: states still not acknowledged go again, or over TCP once a client has
+    // not acknowledged kMaxDatagramResends of them. Such a client gets states over TCP until it is
+    // heard from over UDP again.
+    void resendStates(std::chrono::steady_clock::time_point now) {
+        for (auto& pair : connections) {
+            DatagramPeer& peer = pair.second.datagram;
+            if (!peer.state || peer.stateDue || now < peer.stateSentAt + peer.rtt.resendTimeout(peer.resends)) continue;
+            if (peer.resends == kMaxDatagramResends) {
+                queue(pair.second, peer.state);
+                messages.unref(peer.state);
+                peer.state = nullptr;
+                peer.confirmed = false;
+                continue;
+            }
+            peer.resends++;
+            peer.stateDue = true;
+            metrics().stateResends.add();
+        }
+    }
+
+    // Plays the next queued command of a player. Returns false for the shutdown command, which ends the match.
+    bool applyCommand(Connection& connection, std::chrono::steady_clock::time_point wakeTime) {
+        int playerId = connection.playerId;
+        uint8_t opcode = connection.popCommand();
+        if (opcode == kShutdownCommand){
+            journalInput(playerId, kJournalShutdown, wakeTime);
+            log("Match shutdown initiated.");
+            finished = true;
+            return false;
+        }
+        journalInput(playerId, opcode, wakeTime);
+        std::string_view command = opcodeToText(static_cast<Opcode>(opcode));
+        std::string_view username = game.name(playerId);
+        if (isAttackCommand(command)) {
+            logDebug("Attack command received from ", username, ": ", command);
+            int eliminated = processAttackCommand(playerId, game, command);
+            if (eliminated >= 0) {
+                metrics().eliminations.add();
+                log("Player ", game.name(eliminated), " eliminated by ", username);
+                // Send update to all clients about the elimination
+                broadcastElimination(eliminated);
+            }
+        } else {
+            // Update player direction and log it
+            logDirectionReceived(username, command);
+            game.flags[playerId] |= kPlayerMoved;
+            updatePlayerPosition(playerId, command, game);
+        }
+        connection.receivedDirection = true;
+        lastInputTime = wakeTime;
+        return true;
+    }
+
+    // Consumes every queued input, resolving each turn they complete. In real-time mode inputs wait for the next tick.
+    void processInputs(std::chrono::steady_clock::time_point wakeTime) {
+        if (!started || finished || settings.tickRate > 0) return;
+
+        // Inputs sent ahead of the turn they belong to stay queued, so keep resolving while they can complete a turn
+        bool turnResolved;
+        do {
+            turnResolved = false;
+            bool allDirectionsReceived = true;
+
+            for (auto& pair : connections) {
+                Connection& connection = pair.second;
+                int playerId = connection.playerId;
+
+                if (!connection.receivedDirection && !game.isEliminated(playerId)) {
+                    if (connection.commandCount > 0) {
+                        if (!applyCommand(connection, wakeTime)) return;
+
+                        // Update list status
+                        FrameWriter frame(frameScratch, sizeof(frameScratch));
+                        frame.begin(MessageType::MoveMade).u8(playerId).end();
+                        broadcastCharacter(MessageType::MoveMade, 'L', playerId, frame);
                     } else {
-                        // Update player direction and log it
-                        player->lastDirection = command;
-                        logDirectionReceived(player->username, command);
-                        receivedDirections[socket] = true;
-                        player->hasMoved = true;
-                        updatePlayerPosition(player, command, players);
+                        allDirectionsReceived = false;
                     }
+                } else if (game.isEliminated(playerId)) {
+                    connection.commandCount = 0; // Eliminated players have nothing left to say
+                }
+            }
 
-                    // Update list status
-                    std::string listUpdate = "L" + std::string(1, player->character) + "|";
-                    for (const auto &innerPair: socketToPlayerMap) {
-                        send(innerPair.first, listUpdate.c_str(), listUpdate.length(), 0);
-                    }
-                } else {
-                    allDirectionsReceived = false;
+            if (allDirectionsReceived) {
+                resolveTurn();
+                turnResolved = true;
+            }
+        } while (turnResolved && hasQueuedCommands());
+    }
+
+    // A real-time tick: every player's oldest queued command is played and the state goes out, whoever
+    // sent nothing stands still. Ticks the thread woke up too late for are skipped, not played back to
+    // back, the clients only need the newest state.
+    void onTick(std::chrono::steady_clock::time_point now) {
+        for (auto& pair : connections) {
+            Connection& connection = pair.second;
+            if (game.isEliminated(connection.playerId)) {
+                connection.commandCount = 0;
+            } else if (connection.commandCount > 0) {
+                if (!applyCommand(connection, now)) return;
+            }
+        }
+
+        // The wheel has millisecond ticks, so this may run up to a millisecond before the tick is due
+        tickNumber++;
+        while (tickTime(tickNumber + 1) <= now) {
+            tickNumber++;
+            metrics().skippedTicks.add();
+        }
+        resolveTurn(true);
+    }
+
+    // The turn deadline passed: players who have not sent a command skip this turn
+    void onTurnDeadline(std::chrono::steady_clock::time_point now) {
+        if (!started || finished) return;
+        if (settings.tickRate > 0) {
+            onTick(now);
+            return;
+        }
+
+        for (auto& pair : connections) {
+            Connection& connection = pair.second;
+            int playerId = connection.playerId;
+            if (!connection.receivedDirection && !game.isEliminated(playerId)) {
+                log("Player ", game.name(playerId), " missed the turn deadline.");
+                journalInput(playerId, static_cast<uint8_t>(Opcode::None), now);
+                connection.receivedDirection = true;
+            }
+        }
+        resolveTurn(true);
+        processInputs(now); // Commands queued for the next turns may be waiting
+    }
+
+    ~Room() {
+        // Close all client sockets
+        while (!connections.empty()) {
+            closeSocket(connections.begin()->first);
+        }
+        while (!spectators.empty()) {
+            removeSpectator(spectators.begin()->first);
+        }
+        releaseSnapshots();
+
+        if (started) {
+            log("Room resources cleaned up.");
+        }
+    }
+};
+
+// Runs a shard of rooms on its own thread and transport. The only shared state is the hand-off
+// queue of newly filled rooms and of UDP sockets and spectators for them, everything on the turn
+// path is owned by this thread.
+class Worker {
+private:
+    // A UDP socket the lobby connected to a client of one of our rooms, see Room::bindDatagram()
+    struct IncomingDatagram {
+        int roomId;
+        uint32_t secret;
+        int socket;
+    };
+
+    // A connection that asked the lobby to watch one of our rooms
+    struct IncomingSpectator {
+        int roomId;
+        int socket;
+        Protocol protocol;
+    };
+
+    int id;
+    std::unique_ptr<Transport> transport; // Sockets stay here until they close, so input is received for us
+    TimerWheel<Room> timers;  // Turn deadlines and real-time ticks of every room on this thread
+    TimerWheel<Room> resends; // States clients have not acknowledged over UDP
+    int wake_fd;
+    std::thread thread;
+    std::mutex incomingMutex;
+    std::vector<std::unique_ptr<Room>> incoming;
+    std::vector<IncomingDatagram> incomingDatagrams;
+    std::vector<IncomingSpectator> incomingSpectators;
+    std::unordered_map<int, std::unique_ptr<Room>> rooms; // Room id to room
+    std::unordered_map<int, Room*> socketToRoom;
+
+    // Adopted rooms join touched, input that came with the handshakes may already complete a turn
+    void adoptIncomingRooms(std::vector<Room*>& touched) {
+        uint64_t value;
+        while (read(wake_fd, &value, sizeof(value)) > 0) {}
+
+        std::vector<std::unique_ptr<Room>> adopted;
+        std::vector<IncomingDatagram> datagrams;
+        std::vector<IncomingSpectator> spectators;
+        {
+            std::lock_guard<std::mutex> guard(incomingMutex);
+            adopted.swap(incoming);
+            datagrams.swap(incomingDatagrams);
+            spectators.swap(incomingSpectators);
+        }
+        for (auto& room : adopted) {
+            for (int socket : room->getSockets()) {
+                socketToRoom[socket] = room.get();
+            }
+            room->attach(*transport, &timers, &resends);
+            room->start();
+            touched.push_back(room.get());
+            rooms[room->getId()] = std::move(room);
+        }
+        metrics().activeRooms.set(rooms.size());
+
+        // Rooms first, a socket may be for a room that came in the same batch
+        for (const IncomingDatagram& datagram : datagrams) {
+            auto it = rooms.find(datagram.roomId);
+            if (it == rooms.end() || !it->second->bindDatagram(datagram.secret, datagram.socket)) {
+                close(datagram.socket);
+            } else {
+                socketToRoom[datagram.socket] = it->second.get();
+            }
+            if (it != rooms.end()) {
+                touched.push_back(it->second.get()); // Answers the bind
+            }
+        }
+        // The match may be over already
+        for (const IncomingSpectator& spectator : spectators) {
+            auto it = rooms.find(spectator.roomId);
+            if (it == rooms.end()) {
+                close(spectator.socket);
+                continue;
+            }
+            it->second->addSpectator(spectator.socket, spectator.protocol);
+            socketToRoom[spectator.socket] = it->second.get();
+            touched.push_back(it->second.get());
+        }
+    }
+
+    int timeoutMs(std::chrono::steady_clock::time_point now) const {
+        int deadline = timers.timeoutMs(now);
+        int resend = resends.timeoutMs(now);
+        return deadline < 0 ? resend : resend < 0 ? deadline : std::min(deadline, resend);
+    }
+
+    void retireRoom(Room* room) {
+        for (auto it = socketToRoom.begin(); it != socketToRoom.end();) {
+            it = it->second == room ? socketToRoom.erase(it) : std::next(it);
+        }
+        rooms.erase(room->getId());
+        metrics().activeRooms.set(rooms.size());
+    }
+
+    void run() {
+        std::vector<Room*> touched;
+        std::vector<Room*> expired;
+        while (true) {
+            int ready = transport->wait(timeoutMs(std::chrono::steady_clock::now()));
+            auto wakeTime = std::chrono::steady_clock::now();
+
+            touched.clear();
+            bool woken = false;
+            for (int i = 0; i < ready; ++i) {
+                const TransportEvent& event = transport->event(i);
+                if (event.fd == wake_fd) {
+                    woken = true;
+                    continue;
+                }
+                auto it = socketToRoom.find(event.fd);
+                if (it != socketToRoom.end()) {
+                    it->second->onEvent(event);
+                    touched.push_back(it->second);
+                }
+            }
+            // Only once this wakeup's events are handled, one may still name an fd the new rooms reuse
+            if (woken) {
+                adoptIncomingRooms(touched);
+            }
+
+            // Several sockets of one room may have fired, process each room once
+            std::sort(touched.begin(), touched.end());
+            touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+            for (Room* room : touched) {
+                room->processInputs(wakeTime);
+            }
+
+            // Rooms still waiting on someone once their deadline passed play the turn without them,
+            // real-time rooms play their tick
+            expired.clear();
+            timers.advance(wakeTime, [&](Room* room) { expired.push_back(room); });
+            for (Room* room : expired) {
+                room->onTurnDeadline(wakeTime);
+                touched.push_back(room);
+            }
+            resends.advance(wakeTime, [&](Room* room) {
+                room->resendStates(wakeTime);
+                touched.push_back(room);
+            });
+
+            // Everything the rooms queued during this wakeup goes out now, one write per client.
+            // Finished rooms are retired after their last messages were flushed.
+            std::sort(touched.begin(), touched.end());
+            touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+            for (Room* room : touched) {
+                room->flushOutput();
+            }
+            transport->submitSends();
+            for (Room* room : touched) {
+                if (room->isFinished()) {
+                    retireRoom(room);
                 }
             }
         }
+    }
 
-        if (allDirectionsReceived) {
-            // Prepare 'R|P' command with positions
-            std::string positions = generatePositions(players);
-            std::string resetAndPositionsCommand = "R|P" + positions + "|";
+public:
+    Worker(int id, ServerNetwork& network) : id(id), transport(network.createTransport(true)) {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        transport->watch(wake_fd);
+        thread = std::thread(&Worker::run, this);
+        thread.detach();
+    }
 
-            // Log the position update
-            logPositionUpdate(positions);
-            std::cout << "[" << getCurrentTimestamp() << "] Sending position update to clients: " << resetAndPositionsCommand << std::endl;
+    int getId() const {
+        return id;
+    }
+
+    // Called from the lobby thread once a room is full
+    void adopt(std::unique_ptr<Room> room) {
+        {
+            std::lock_guard<std::mutex> guard(incomingMutex);
+            incoming.push_back(std::move(room));
+        }
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+
+    // Called from the lobby thread for a client of a room it handed to us
+    void adoptDatagram(int roomId, uint32_t secret, int socket) {
+        {
+            std::lock_guard<std::mutex> guard(incomingMutex);
+            incomingDatagrams.push_back({roomId, secret, socket});
+        }
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
 
-            // Send reset and positions command to all clients
-            for (const auto& pair : socketToPlayerMap) {
-                send(pair.first, resetAndPositionsCommand.c_str(), resetAndPositionsCommand.length(), 0);
+    // Called from the lobby thread for a spectator of a room it handed to us
+    void adoptSpectator(int roomId, int socket, Protocol protocol) {
+        {
+            std::lock_guard<std::mutex> guard(incomingMutex);
+            incomingSpectators.push_back({roomId, socket, protocol});
+        }
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+};
+
+enum class HandshakeStatus {
+    Complete,
+    Incomplete, // Wait for more bytes
+    Invalid
+};
+
+// Reads the first message of a connection, which also decides the wire format it will use.
+// consumed is set to the length of the handshake, anything after it is the client's first input.
+// watchRoom is -1 for a player, for a spectator the room it asked for or 0 for the newest match.
+HandshakeStatus parseHandshake(const uint8_t* data, size_t size, std::string& username, char& character,
+                               Protocol& protocol, bool& delimited, size_t& consumed, int& watchRoom) {
+    watchRoom = -1;
+    if (size == 0) {
+        return HandshakeStatus::Incomplete;
+    }
+    if (data[0] == kBinaryPreamble[0]) {
+        if (std::memcmp(data, kBinaryPreamble, std::min(size, sizeof(kBinaryPreamble))) != 0) {
+            return HandshakeStatus::Invalid; // Unknown protocol version
+        }
+        Frame frame;
+        if (size < sizeof(kBinaryPreamble) ||
+            !peekFrame(data + sizeof(kBinaryPreamble), size - sizeof(kBinaryPreamble), frame)) {
+            return HandshakeStatus::Incomplete;
+        }
+        protocol = Protocol::Binary;
+        delimited = true;
+        consumed = sizeof(kBinaryPreamble) + frame.totalSize;
+        PayloadReader reader(frame);
+        if (frame.type == MessageType::Watch) {
+            uint32_t roomId = reader.u32();
+            if (!reader.good() || roomId > INT32_MAX) {
+                return HandshakeStatus::Invalid;
             }
+            watchRoom = roomId;
+            return HandshakeStatus::Complete;
+        }
+        if (frame.type != MessageType::Hello) {
+            return HandshakeStatus::Invalid;
+        }
+        character = reader.u8();
+        uint8_t nameLength = reader.u8();
+        const uint8_t* name = reader.bytes(nameLength);
+        if (!reader.good()) {
+            return HandshakeStatus::Invalid;
+        }
+        username.assign(reinterpret_cast<const char*>(name), nameLength);
+        return HandshakeStatus::Complete;
+    }
+
+    std::string text(reinterpret_cast<const char*>(data), strnlen(reinterpret_cast<const char*>(data), size));
+    size_t end = text.find('|');
+    delimited = end != std::string::npos;
+    consumed = delimited ? end + 1 : size;
+    text = text.substr(0, end);
 
-            // Reset the directions and move status
-            for(auto& player : players) {
-                player->hasMoved = false;
+    // Spectators send "WATCH <room id>|", or "WATCH|" for the newest match
+    if (delimited && text.compare(0, 5, "WATCH") == 0 && text.find(',') == std::string::npos) {
+        std::string_view roomId = std::string_view(text).substr(5);
+        watchRoom = 0;
+        if (!roomId.empty()) {
+            auto result = std::from_chars(roomId.data() + 1, roomId.data() + roomId.size(), watchRoom);
+            if (roomId[0] != ' ' || result.ec != std::errc() || result.ptr != roomId.data() + roomId.size() ||
+                watchRoom < 0) {
+                return HandshakeStatus::Invalid;
             }
-            for(auto& pair : receivedDirections) {
-                pair.second = false;
+        }
+        protocol = Protocol::Text;
+        return HandshakeStatus::Complete;
+    }
+
+    // Older clients do not end the handshake with '|', it is complete once the character arrived
+    size_t commaPos = text.find(',');
+    if (commaPos == std::string::npos || commaPos + 1 >= text.size()) {
+        return delimited ? HandshakeStatus::Invalid : HandshakeStatus::Incomplete;
+    }
+    username = text.substr(0, commaPos);
+    character = text[commaPos + 1];
+    protocol = Protocol::Text;
+    return HandshakeStatus::Complete;
+}
+
+// A connection that has not finished its handshake yet. Handshakes are recycled through a pool, so
+// a connection that comes and goes does not allocate the handshake or its buffer.
+struct Handshake {
+    static const size_t kMaxSize = 1024; // Handshake plus whatever input came right behind it
+
+    int socket = -1;
+    ReceiveBuffer inbox{kMaxSize};
+    TimerWheel<Handshake>::Timer deadline{this};
+};
+
+// Runs on the main thread: accepts connections, reads their handshakes and seats them in the room
+// being filled, which goes to a worker once it is full. Every step is non-blocking and any number of
+// handshakes can be in flight, so a client that connects and says nothing only holds up itself
+// until its deadline.
+class Lobby {
+private:
+    static constexpr std::chrono::seconds kHandshakeTimeout{5};
+
+    ServerNetwork& network;
+    MatchSettings settings;
+    std::vector<std::unique_ptr<Worker>>& workers;
+    std::unique_ptr<Transport> transport; // Reports readiness only, sockets move to a worker with nothing in flight
+    TimerWheel<Handshake> timers;
+    ObjectPool<Handshake> handshakePool;
+    std::unordered_map<int, Handshake*> handshakes; // Maps socket FD to its handshake
+    std::unique_ptr<Room> room; // The room being filled
+    int nextRoomId = 1;
+
+    // Rooms are handed out round robin in the order they fill, which is the order of their ids
+    Worker& workerFor(int roomId) {
+        return *workers[(roomId - 1) % workers.size()];
+    }
+
+    void openRoom() {
+        room = std::make_unique<Room>(nextRoomId++, settings);
+        room->attach(*transport);
+    }
+
+    void onAccepted(int socket, std::chrono::steady_clock::time_point now) {
+        network.setNoDelay(socket);
+
+        Handshake* handshake = handshakePool.acquire();
+        handshake->socket = socket;
+        handshake->inbox.clear();
+        timers.arm(handshake->deadline, now + kHandshakeTimeout);
+        transport->add(socket); // Reports the socket right away if the handshake is already there
+        handshakes[socket] = handshake;
+    }
+
+    // Forgets the handshake, the socket stays open
+    void releaseHandshake(int socket) {
+        auto it = handshakes.find(socket);
+        it->second->deadline.cancel();
+        handshakePool.release(it->second);
+        handshakes.erase(it);
+    }
+
+    void closeHandshake(int socket) {
+        transport->remove(socket);
+        close(socket);
+        releaseHandshake(socket);
+    }
+
+    void onHandshakeReadable(Handshake& handshake) {
+        int socket = handshake.socket;
+        size_t buffered = handshake.inbox.size();
+        ReceiveBuffer::ReadStatus readStatus = handshake.inbox.readFrom(socket);
+        metrics().bytesIn.add(handshake.inbox.size() - buffered);
+
+        std::string username;
+        char character;
+        Protocol protocol;
+        bool delimited;
+        size_t consumed;
+        int watchRoom;
+        std::string_view data = handshake.inbox.all();
+        HandshakeStatus status = parseHandshake(reinterpret_cast<const uint8_t*>(data.data()), data.size(), username,
+                                                character, protocol, delimited, consumed, watchRoom);
+        if (status == HandshakeStatus::Incomplete &&
+            readStatus == ReceiveBuffer::ReadStatus::Drained && !handshake.inbox.full()) {
+            return;
+        }
+        if (status != HandshakeStatus::Complete) {
+            closeHandshake(socket);
+            return;
+        }
+        if (watchRoom >= 0) {
+            releaseHandshake(socket);
+            seatSpectator(socket, watchRoom, protocol);
+            return;
+        }
+
+        metrics().messagesIn[static_cast<int>(MessageType::Hello)].add();
+
+        bool seated = room->addPlayer(socket, username, character, protocol, delimited,
+                                      reinterpret_cast<const uint8_t*>(data.data()) + consumed,
+                                      data.size() - consumed);
+        releaseHandshake(socket); // The room copied what it needs out of the inbox
+        if (!seated) {
+            if (protocol == Protocol::Binary) {
+                uint8_t response[kFrameHeaderSize];
+                FrameWriter frame(response, sizeof(response));
+                frame.begin(MessageType::Taken).end();
+                sendToClient(socket, frame.data(), frame.length(), MessageType::Taken);
+            } else {
+                std::string response = "taken";
+                sendToClient(socket, response.c_str(), response.length(), MessageType::Taken);
+            }
+            transport->remove(socket);
+            close(socket);
+            return;
+        }
+
+        logConnection(username, character);  // Log new connection
+
+        if (room->isFull()) {
+            Worker& worker = workerFor(room->getId());
+            LOG_INFO("Room ", room->getId(), " is full, handing it to worker ", worker.getId(), ".");
+            room->flushOutput(); // Whatever the socket buffers do not take goes with the room
+            transport->submitSends();
+            room->detach();
+            worker.adopt(std::move(room));
+            openRoom();
+        }
+    }
+
+    // Room 0 is the match handed to a worker last, or the one being filled if none was yet. A spectator
+    // of a match that is over or does not exist is disconnected.
+    void seatSpectator(int socket, int roomId, Protocol protocol) {
+        metrics().messagesIn[static_cast<int>(MessageType::Watch)].add();
+        if (roomId == 0) {
+            roomId = std::max(room->getId() - 1, 1);
+        }
+        if (roomId == room->getId()) {
+            room->addSpectator(socket, protocol);
+            return;
+        }
+        transport->remove(socket);
+        if (roomId < room->getId()) {
+            workerFor(roomId).adoptSpectator(roomId, socket, protocol);
+        } else {
+            close(socket);
+        }
+    }
+
+    // Clients in UDP mode send DatagramBind to the shared socket until they hear back. Each one gets a
+    // socket connected to it, which takes all its later datagrams, for the room it is in.
+    void onDatagramReadable() {
+        uint8_t buffer[kDatagramBufferSize];
+        while (true) {
+            struct sockaddr_in peer;
+            socklen_t length = sizeof(peer);
+            ssize_t size = recvfrom(network.getDatagramFd(), buffer, sizeof(buffer), MSG_DONTWAIT,
+                                    reinterpret_cast<struct sockaddr*>(&peer), &length);
+            if (size < 0 && errno == EINTR) continue;
+            if (size < 0) return;
+            metrics().bytesIn.add(size);
+
+            // Anything else is left over from a client whose own socket is gone
+            Frame frame;
+            if (!peekFrame(buffer, size, frame) || frame.type != MessageType::DatagramBind) continue;
+            PayloadReader reader(frame);
+            uint32_t roomId = reader.u32();
+            uint32_t secret = reader.u32();
+            if (!reader.good() || roomId == 0 || roomId > static_cast<uint32_t>(room->getId())) continue;
+            metrics().messagesIn[static_cast<int>(MessageType::DatagramBind)].add();
+            // Only a client that was offered UDP mode in this room gets a socket
+            if (!DatagramOffers::instance().matches(roomId, secret)) continue;
+
+            int socket = network.connectDatagram(peer);
+            if (socket < 0) continue;
+            if (static_cast<int>(roomId) < room->getId()) {
+                workerFor(roomId).adoptDatagram(roomId, secret, socket);
+            } else if (!room->bindDatagram(secret, socket)) {
+                close(socket);
             }
         }
-        usleep(100000); // Small delay
     }
 
-    // Cleanup and close sockets
-    for (Player* player : players) {
-        delete player;
+public:
+    Lobby(ServerNetwork& network, const MatchSettings& settings, std::vector<std::unique_ptr<Worker>>& workers) :
+            network(network), settings(settings), workers(workers),
+            transport(network.createTransport(false, 1024)) { // Room for a burst of connections per wakeup
+        transport->listen(network.getServerFd());
+        if (network.getDatagramFd() >= 0) {
+            transport->watch(network.getDatagramFd());
+        }
+        openRoom();
+    }
+
+    void run() {
+        std::vector<int> expired;
+        while (true) {
+            int ready = transport->wait(timers.timeoutMs(std::chrono::steady_clock::now()));
+            auto now = std::chrono::steady_clock::now();
+            for (int i = 0; i < ready; ++i) {
+                const TransportEvent& event = transport->event(i);
+                if (event.type == TransportEvent::Type::Accepted) {
+                    onAccepted(event.fd, now);
+                    continue;
+                }
+                if (event.fd == network.getDatagramFd()) {
+                    onDatagramReadable();
+                    continue;
+                }
+                auto it = handshakes.find(event.fd);
+                if (it != handshakes.end()) {
+                    if (event.type != TransportEvent::Type::Writable) {
+                        onHandshakeReadable(*it->second);
+                    }
+                } else {
+                    // Lobby clients are not expected to talk yet, keep whatever arrives for the first turn
+                    room->onEvent(event);
+                }
+            }
+            room->flushOutput();
+            transport->submitSends();
+
+            expired.clear();
+            timers.advance(now, [&](Handshake* handshake) { expired.push_back(handshake->socket); });
+            for (int socket : expired) {
+                LOG_DEBUG("Closing a connection that sent no handshake.");
+                closeHandshake(socket);
+            }
+        }
+    }
+};
+
+// bench.cpp includes this file to drive a real Room and leaves out the entry point
+#ifndef ARENA_NO_SERVER_MAIN
+int main(int argc, char* argv[]) {
+    // The client draws a 24x10 arena unless told otherwise
+    MatchSettings settings;
+    int playersPerMatch = 4;
+    std::string metricsSocket, metricsFile;
+    int metricsInterval = 10;
+    std::string transportName = "epoll";
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--width") settings.width = std::atoi(argv[i + 1]);
+        else if (option == "--height") settings.height = std::atoi(argv[i + 1]);
+        else if (option == "--players") playersPerMatch = std::atoi(argv[i + 1]);
+        else if (option == "--journal") settings.journalDirectory = argv[i + 1];
+        else if (option == "--turn-timeout") settings.turnTimeout = std::chrono::milliseconds(std::atoi(argv[i + 1]));
+        else if (option == "--tick-rate") settings.tickRate = std::atoi(argv[i + 1]);
+        else if (option == "--view-radius") settings.viewRadius = std::atoi(argv[i + 1]);
+        else if (option == "--metrics-socket") metricsSocket = argv[i + 1];
+        else if (option == "--metrics-file") metricsFile = argv[i + 1];
+        else if (option == "--metrics-interval") metricsInterval = std::atoi(argv[i + 1]);
+        else if (option == "--transport") transportName = argv[i + 1];
+    }
+    if (settings.width < 4 || settings.height < 4 || settings.width > 1000 || settings.height > 1000) {
+        std::cerr << "Arena width and height must be between 4 and 1000." << std::endl;
+        return 1;
+    }
+    // Player ids are a single byte on the wire
+    if (playersPerMatch < 2 || playersPerMatch > 255 || playersPerMatch > (settings.width - 2) * (settings.height - 2)) {
+        std::cerr << "Players per match must be between 2 and 255 and fit in the arena." << std::endl;
+        return 1;
+    }
+    if (settings.turnTimeout.count() < 0) {
+        std::cerr << "Turn timeout must be 0 (no timeout) or a number of milliseconds." << std::endl;
+        return 1;
+    }
+    if (settings.tickRate < 0 || settings.tickRate > 1000) {
+        std::cerr << "Tick rate must be 0 (turn-based) or between 1 and 1000 ticks per second." << std::endl;
+        return 1;
+    }
+    if (settings.viewRadius < 0 || settings.viewRadius > 1000) {
+        std::cerr << "View radius must be 0 (see everyone) or between 1 and 1000 tiles." << std::endl;
+        return 1;
     }
-    for (const auto& pair : socketToPlayerMap) {
-        close(pair.first);
+    if (transportName != "epoll" && transportName != "io_uring") {
+        std::cerr << "Transport must be epoll or io_uring." << std::endl;
+        return 1;
+    }
+    if (metricsInterval < 1) {
+        std::cerr << "Metrics interval must be at least 1 second." << std::endl;
+        return 1;
+    }
+    settings.spawnPoints = generateSpawnPoints(playersPerMatch, settings.width, settings.height);
+    if (!Metrics::instance().startExporter(metricsSocket, metricsFile, std::chrono::seconds(metricsInterval))) {
+        std::cerr << "Cannot serve metrics on " << metricsSocket << "." << std::endl;
+        return 1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    ServerNetwork serverNetwork;
+    serverNetwork.setNonBlocking(serverNetwork.getServerFd());
+    settings.datagrams = serverNetwork.getDatagramFd() >= 0;
+    if (transportName == "io_uring") {
+        serverNetwork.transportKind = TransportKind::IoUring;
+    }
+
+    unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < workerCount; ++i) {
+        workers.push_back(std::make_unique<Worker>(i, serverNetwork));
+    }
+    Lobby lobby(serverNetwork, settings, workers);
+    LOG_INFO("Started ", workerCount, " worker threads on ",
+             serverNetwork.transportKind == TransportKind::IoUring ? "io_uring" : "epoll", ".");
+    lobby.run();
+}
+#endif
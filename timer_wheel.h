@@ -0,0 +1,165 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Hierarchical timer wheel with millisecond ticks. Four levels of 64 slots cover deadlines up to
+// 64^4 ms (about 4.6 hours) ahead; a timer further out than its level's reach waits in a coarser
+// level and is moved down as the wheel turns. Timers are intrusive list nodes embedded in their
+// owner, so arming and cancelling are O(1) and never allocate.
+//
+// Not thread safe, each worker thread keeps its own wheel.
+template <typename Owner>
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    class Timer {
+    private:
+        friend class TimerWheel;
+
+        Timer* prev = this; // Circular list, a lone timer points at itself
+        Timer* next = this;
+        TimerWheel* wheel = nullptr; // Set while armed
+        uint64_t expiry = 0;         // Tick the timer fires at
+
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+
+    public:
+        Owner* const owner;
+
+        explicit Timer(Owner* owner = nullptr) : owner(owner) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        bool isArmed() const {
+            return wheel != nullptr;
+        }
+
+        void cancel() {
+            if (wheel) {
+                unlink();
+                wheel->armed--;
+                wheel = nullptr;
+            }
+        }
+
+        ~Timer() {
+            cancel();
+        }
+    };
+
+private:
+    static const int kLevels = 4;
+    static const int kSlotBits = 6;
+    static const uint64_t kSlots = 1 << kSlotBits;
+    static const uint64_t kSlotMask = kSlots - 1;
+
+    Clock::time_point origin = Clock::now();
+    uint64_t currentTick = 0;
+    size_t armed = 0;
+    Timer slots[kLevels][kSlots]; // List heads, only their links are used
+
+    uint64_t tickAt(Clock::time_point time) const {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(time - origin).count();
+        return elapsed > 0 ? elapsed : 0;
+    }
+
+    void insert(Timer& timer) {
+        uint64_t delta = timer.expiry - currentTick;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (kSlots << (kSlotBits * level))) {
+            level++;
+        }
+        uint64_t maxDelta = (kSlots << (kSlotBits * level)) - 1;
+        if (delta > maxDelta) {
+            timer.expiry = currentTick + maxDelta; // Beyond the wheel's reach, fire as late as it can
+        }
+        Timer& head = slots[level][(timer.expiry >> (kSlotBits * level)) & kSlotMask];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    // Moves the timers of the slot that just came due one level down, or into level 0
+    void cascade(int level) {
+        Timer& head = slots[level][(currentTick >> (kSlotBits * level)) & kSlotMask];
+        while (head.next != &head) {
+            Timer* timer = head.next;
+            timer->unlink();
+            insert(*timer);
+        }
+    }
+
+public:
+    TimerWheel() = default;
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Re-arming an armed timer moves it to the new deadline
+    void arm(Timer& timer, Clock::time_point deadline) {
+        timer.cancel();
+        uint64_t expiry = tickAt(deadline);
+        timer.expiry = expiry > currentTick ? expiry : currentTick + 1;
+        timer.wheel = this;
+        armed++;
+        insert(timer);
+    }
+
+    bool empty() const {
+        return armed == 0;
+    }
+
+    // How long the caller may sleep before advance() has work to do, -1 when nothing is armed.
+    // Only looks at level 0, so a far-off deadline costs a wakeup every 64 ms.
+    int timeoutMs(Clock::time_point now) const {
+        if (armed == 0) return -1;
+        uint64_t nowTick = tickAt(now);
+        if (nowTick < currentTick) nowTick = currentTick;
+        uint64_t tick = currentTick + 1;
+        for (; (tick & kSlotMask) != 0; ++tick) {
+            const Timer& head = slots[0][tick & kSlotMask];
+            if (head.next != &head) break;
+        }
+        // Either the first occupied slot or the next cascade
+        return tick > nowTick ? static_cast<int>(tick - nowTick) : 0;
+    }
+
+    // Fires every timer due by now. onExpired(Owner*) may re-arm or cancel any timer.
+    template <typename Handler>
+    void advance(Clock::time_point now, Handler onExpired) {
+        uint64_t target = tickAt(now);
+        while (currentTick < target) {
+            if (armed == 0) {
+                currentTick = target;
+                break;
+            }
+            currentTick++;
+            for (int level = 1; level < kLevels; ++level) {
+                if ((currentTick & ((uint64_t(1) << (kSlotBits * level)) - 1)) != 0) break;
+                cascade(level);
+            }
+            Timer& head = slots[0][currentTick & kSlotMask];
+            while (head.next != &head) {
+                Timer* timer = head.next;
+                timer->cancel();
+                onExpired(timer->owner);
+            }
+        }
+    }
+
+    ~TimerWheel() {
+        for (auto& level : slots) {
+            for (Timer& head : level) {
+                while (head.next != &head) {
+                    head.next->cancel();
+                }
+            }
+        }
+    }
+};
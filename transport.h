@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "logger.h"
+#include "metrics.h"
+#include "outbox.h"
+
+// How a thread drives its sockets. The lobby and every worker own a transport and only ever use it
+// from their own thread. There are two backends:
+//  - EpollTransport (below) reports readiness, the owner reads a socket itself when it is readable
+//    and every send is a sendmsg() right away.
+//  - IoUringTransport (uring_transport.h) hands accepts, receives and sends to the kernel in batches,
+//    so a wakeup costs a couple of syscalls however many sockets took part in it.
+
+struct TransportEvent {
+    enum class Type : uint8_t {
+        Accepted, // fd is a new non-blocking connection on the listening socket
+        Readable, // fd has input or was closed, read it with ReceiveBuffer::readFrom()
+        Received, // The transport read size bytes of fd into data, valid until the next wait()
+        Closed,   // The transport found fd closed by the peer or failed
+        Writable  // Output a full socket buffer held back can go out now
+    };
+
+    Type type;
+    int fd;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+enum class TransportKind {
+    Epoll,
+    IoUring
+};
+
+class Transport {
+protected:
+    std::vector<TransportEvent> events;
+
+    // Takes the outcome of writing an outbox and counts the bytes that went out
+    static Outbox::FlushStatus sent(Outbox& outbox, MessagePool& pool, ssize_t result, int error) {
+        if (result > 0) metrics().bytesOut.add(result);
+        return outbox.complete(result, error, pool);
+    }
+
+public:
+    virtual ~Transport() = default;
+
+    virtual const char* name() const = 0;
+
+    // Reports every connection accepted on a listening socket as an Accepted event
+    virtual bool listen(int fd) = 0;
+
+    // Reports fd as Readable whenever it gets input, for descriptors that are not client sockets (an eventfd)
+    virtual bool watch(int fd) = 0;
+
+    // Starts reporting the input and writability of a client socket. Adding a socket twice changes nothing.
+    virtual bool add(int fd) = 0;
+
+    // Stops reporting fd, call it before closing fd or handing it to another thread
+    virtual void remove(int fd) = 0;
+
+    // Writes what outbox holds, right away or with the next submitSends(). The outbox must stay until then.
+    virtual void send(int fd, Outbox& outbox, MessagePool& pool) = 0;
+
+    // Writes everything passed to send() since the last call
+    virtual void submitSends() {}
+
+    // Blocks until there are events or the timeout (-1 waits forever) passed, returns the number of events
+    virtual int wait(int timeoutMs) = 0;
+
+    const TransportEvent& event(int i) const {
+        return events[i];
+    }
+};
+
+// Edge-triggered epoll. Registered fds must be non-blocking and drained until EAGAIN.
+class EpollTransport : public Transport {
+private:
+    static const uint32_t kClientEvents = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+    int epoll_fd;
+    int listenFd = -1;
+    std::vector<struct epoll_event> ready;
+
+    bool control(int fd, uint32_t mask) {
+        struct epoll_event ev = {};
+        ev.events = mask;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) return true;
+        return errno == EEXIST && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    void acceptAll() {
+        while (true) {
+            int socket = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EMFILE || errno == ENFILE) {
+                    LOG_WARNING("Out of file descriptors, new connections wait in the backlog.");
+                }
+                return; // Accept queue drained
+            }
+            events.push_back({TransportEvent::Type::Accepted, socket});
+        }
+    }
+
+public:
+    explicit EpollTransport(int maxEvents = 64) : ready(maxEvents) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    EpollTransport(const EpollTransport&) = delete;
+    EpollTransport& operator=(const EpollTransport&) = delete;
+
+    const char* name() const override {
+        return "epoll";
+    }
+
+    bool listen(int fd) override {
+        listenFd = fd;
+        return control(fd, EPOLLIN | EPOLLET);
+    }
+
+    bool watch(int fd) override {
+        return control(fd, EPOLLIN | EPOLLET);
+    }
+
+    bool add(int fd) override {
+        return control(fd, kClientEvents);
+    }
+
+    void remove(int fd) override {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    // What a full socket buffer does not take stays queued, EPOLLOUT reports when it can go out
+    void send(int fd, Outbox& outbox, MessagePool& pool) override {
+        while (!outbox.empty()) {
+            struct iovec segments[Outbox::kMaxSegments];
+            struct msghdr header = {};
+            header.msg_iov = segments;
+            header.msg_iovlen = outbox.prepare(segments, Outbox::kMaxSegments);
+            ssize_t result = sendmsg(fd, &header, MSG_NOSIGNAL);
+            if (result < 0 && errno == EINTR) continue;
+            if (sent(outbox, pool, result, errno) != Outbox::FlushStatus::Flushed) break;
+        }
+    }
+
+    int wait(int timeoutMs) override {
+        events.clear();
+        int n = epoll_wait(epoll_fd, ready.data(), ready.size(), timeoutMs);
+        for (int i = 0; i < n; ++i) {
+            int fd = ready[i].data.fd;
+            uint32_t mask = ready[i].events;
+            if (fd == listenFd) {
+                acceptAll();
+                continue;
+            }
+            if (mask & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                events.push_back({TransportEvent::Type::Readable, fd});
+            }
+            if (mask & EPOLLOUT) {
+                events.push_back({TransportEvent::Type::Writable, fd});
+            }
+        }
+        return events.size();
+    }
+
+    ~EpollTransport() {
+        close(epoll_fd);
+    }
+};
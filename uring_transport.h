@@ -0,0 +1,498 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "transport.h"
+
+// io_uring backend, driven through the raw syscalls. Needs Linux 6.0 or newer: on anything older
+// setup() fails and the server stays on epoll.
+//
+//  - The listening socket has one multishot accept, every connection comes back as a completion.
+//  - In receive mode (the workers) each client socket has a multishot receive that takes its buffer
+//    from a ring registered with the kernel, so input arrives without a read() per socket. A buffer
+//    goes back to the ring on the wait() after the one that reported it.
+//  - Otherwise (the lobby, whose sockets move to a worker once their room is full) client sockets
+//    have a multishot poll and the caller reads them, as with epoll, so no input is ever in flight
+//    when a socket changes threads.
+//  - send() only notes the outbox. submitSends() turns every noted outbox into a SENDMSG and submits
+//    them all with one io_uring_enter(). They do not block, so they complete during that call; a
+//    socket whose buffer is full gets a one-shot poll and reports Writable once it drains.
+//
+// Completions that arrive while submitSends() collects its own are kept for the next wait().
+class IoUringTransport : public Transport {
+private:
+    static const unsigned kQueueDepth = 1024;
+    static const unsigned kCompletionDepth = 8 * kQueueDepth;
+    static const unsigned kBufferCount = 512; // Power of two
+    static const size_t kBufferSize = 2048;
+    static const uint16_t kBufferGroup = 0;
+
+    // user_data holds the operation in the top byte, the generation of the fd below it and the fd
+    // (or the send index) in the low 32 bits. A completion of an older generation belongs to a
+    // socket that was removed since, even if its fd number was reused.
+    enum Operation : uint64_t {
+        Accept = 1,
+        Receive,
+        Poll,
+        PollOut,
+        Send,
+        Cancel
+    };
+
+    struct Socket {
+        uint32_t generation = 0;
+        bool active = false;          // Added or watched, and not removed since
+        bool watchOnly = false;       // Added by watch(), not a client socket
+        bool waitingWritable = false; // One-shot POLLOUT armed after a send would have blocked
+        bool sendQueued = false;      // Noted by send() since the last submitSends()
+    };
+
+    struct PendingSend {
+        int fd;
+        Outbox* outbox; // Null once the socket was removed
+        MessagePool* pool;
+        size_t length;  // Bytes prepared
+        int32_t result;
+        struct msghdr header;
+        struct iovec segments[Outbox::kMaxSegments];
+    };
+
+    bool receiveInKernel;
+    int ringFd = -1;
+    int listenFd = -1;
+    bool acceptStalled = false; // Out of file descriptors, accepting resumes once a socket is removed
+
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0;
+    struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned sqEntries = 0;
+    unsigned sqTailLocal = 0;
+
+    struct io_uring_buf_ring* bufferRing = static_cast<struct io_uring_buf_ring*>(MAP_FAILED);
+    size_t bufferRingSize = 0;
+    std::vector<uint8_t> buffers;
+    uint16_t bufferTail = 0;
+
+    std::vector<Socket> sockets; // By fd
+    std::vector<std::pair<int, uint32_t>> rearm; // Multishot requests that ended, armed again on the next wait()
+    std::vector<TransportEvent> stash;
+    std::vector<PendingSend> pendingSends;
+    unsigned sendsLeft = 0;
+
+    static uint64_t userData(Operation operation, uint32_t generation, uint32_t fd) {
+        return (static_cast<uint64_t>(operation) << 56) | (static_cast<uint64_t>(generation & 0xFFFFFF) << 32) | fd;
+    }
+
+    Socket& slot(int fd) {
+        if (static_cast<size_t>(fd) >= sockets.size()) sockets.resize(fd + 1);
+        return sockets[fd];
+    }
+
+    // Submits whatever was prepared and, with wait set, blocks for a completion or the timeout
+    int enter(bool wait, int timeoutMs) {
+        __atomic_store_n(sqTail, sqTailLocal, __ATOMIC_RELEASE);
+        unsigned toSubmit = sqTailLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        struct __kernel_timespec timeout = {};
+        struct io_uring_getevents_arg arg = {};
+        void* argument = nullptr;
+        size_t argumentSize = 0;
+        if (wait && timeoutMs >= 0) {
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            flags |= IORING_ENTER_EXT_ARG;
+            argument = &arg;
+            argumentSize = sizeof(arg);
+        }
+        long result = syscall(__NR_io_uring_enter, ringFd, toSubmit, wait ? 1 : 0, flags, argument, argumentSize);
+        return result < 0 ? -errno : static_cast<int>(result);
+    }
+
+    struct io_uring_sqe* nextSqe() {
+        if (sqTailLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            enter(false, 0); // Submission queue full, hand it to the kernel first
+        }
+        unsigned index = sqTailLocal & *sqMask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqTailLocal++;
+        return sqe;
+    }
+
+    void armAccept() {
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = userData(Accept, 0, listenFd);
+    }
+
+    void armPoll(int fd, const Socket& socket, uint32_t mask, bool multishot) {
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = mask;
+        sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = userData(multishot ? Poll : PollOut, socket.generation, fd);
+    }
+
+    void armReceive(int fd, const Socket& socket) {
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = userData(Receive, socket.generation, fd);
+    }
+
+    void arm(int fd, const Socket& socket) {
+        if (socket.watchOnly) {
+            armPoll(fd, socket, POLLIN, true);
+        } else if (receiveInKernel) {
+            armReceive(fd, socket);
+        } else {
+            armPoll(fd, socket, POLLIN | POLLOUT | POLLRDHUP, true);
+        }
+    }
+
+    void cancel(uint64_t target) {
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = userData(Cancel, 0, 0);
+    }
+
+    void recycleBuffer(uint16_t id) {
+        // Indexed by hand: compiled as C++, older uapi headers put bufs[] 8 bytes into the ring
+        struct io_uring_buf* entry = reinterpret_cast<struct io_uring_buf*>(bufferRing) + (bufferTail & (kBufferCount - 1));
+        entry->addr = reinterpret_cast<uint64_t>(buffers.data() + id * kBufferSize);
+        entry->len = kBufferSize;
+        entry->bid = id;
+        bufferTail++;
+        __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+    }
+
+    void onCompletion(const struct io_uring_cqe& cqe, std::vector<TransportEvent>& into) {
+        Operation operation = static_cast<Operation>(cqe.user_data >> 56);
+        uint32_t generation = (cqe.user_data >> 32) & 0xFFFFFF;
+        int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        if (operation == Send) {
+            pendingSends[fd].result = cqe.res;
+            sendsLeft--;
+            return;
+        }
+        if (operation == Accept) {
+            if (cqe.res >= 0) {
+                into.push_back({TransportEvent::Type::Accepted, cqe.res});
+            } else if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+                LOG_WARNING("Out of file descriptors, new connections wait in the backlog.");
+            }
+            if (!more) {
+                if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+                    acceptStalled = true;
+                } else {
+                    armAccept();
+                }
+            }
+            return;
+        }
+        if (operation != Receive && operation != Poll && operation != PollOut) return;
+
+        bool current = static_cast<size_t>(fd) < sockets.size() && sockets[fd].active &&
+                       sockets[fd].generation == generation;
+        if (operation == Receive && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (current && cqe.res > 0) {
+                into.push_back({TransportEvent::Type::Received, fd, buffers.data() + id * kBufferSize,
+                                static_cast<size_t>(cqe.res)});
+            } else {
+                recycleBuffer(id);
+            }
+        }
+        if (!current) return; // Completion of a removed socket
+
+        Socket& socket = sockets[fd];
+        if (operation == PollOut) {
+            socket.waitingWritable = false;
+            if (cqe.res > 0) into.push_back({TransportEvent::Type::Writable, fd});
+            return;
+        }
+        if (operation == Receive) {
+            if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS)) {
+                into.push_back({TransportEvent::Type::Closed, fd});
+                return;
+            }
+        } else if (cqe.res > 0) {
+            if (cqe.res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)) {
+                into.push_back({TransportEvent::Type::Readable, fd});
+            }
+            if (cqe.res & POLLOUT) {
+                into.push_back({TransportEvent::Type::Writable, fd});
+            }
+        }
+        if (!more) {
+            rearm.emplace_back(fd, generation); // Out of buffers or ended by the kernel, armed again on the next wait()
+        }
+    }
+
+    void reap(std::vector<TransportEvent>& into) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            onCompletion(cqes[head & *cqMask], into);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    bool setup() {
+        struct io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = kCompletionDepth;
+        ringFd = syscall(__NR_io_uring_setup, kQueueDepth, &params);
+        if (ringFd < 0 && errno == EINVAL) {
+            params = {}; // Kernels before 5.19 do not know COOP_TASKRUN
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = kCompletionDepth;
+            ringFd = syscall(__NR_io_uring_setup, kQueueDepth, &params);
+        }
+        if (ringFd < 0) return false;
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                      IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                                  IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return false;
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        sqTailLocal = *sqTail;
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        if (!receiveInKernel) return true;
+
+        // Buffers the kernel picks from for every receive
+        bufferRingSize = kBufferCount * sizeof(struct io_uring_buf);
+        bufferRing = static_cast<struct io_uring_buf_ring*>(mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE,
+                                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (bufferRing == MAP_FAILED) return false;
+        struct io_uring_buf_reg registration = {};
+        registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+        registration.ring_entries = kBufferCount;
+        registration.bgid = kBufferGroup;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) return false;
+        buffers.resize(kBufferCount * kBufferSize);
+        for (unsigned id = 0; id < kBufferCount; ++id) {
+            recycleBuffer(id);
+        }
+        return true;
+    }
+
+public:
+    // receiveInKernel: client sockets get multishot receives into registered buffers instead of readiness polls
+    explicit IoUringTransport(bool receiveInKernel) : receiveInKernel(receiveInKernel) {}
+
+    IoUringTransport(const IoUringTransport&) = delete;
+    IoUringTransport& operator=(const IoUringTransport&) = delete;
+
+    // Call once before anything else, false if the kernel lacks what this needs
+    bool start() {
+        return setup();
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    bool listen(int fd) override {
+        listenFd = fd;
+        armAccept();
+        return true;
+    }
+
+    bool watch(int fd) override {
+        Socket& socket = slot(fd);
+        if (socket.active) return true;
+        socket.active = true;
+        socket.watchOnly = true;
+        arm(fd, socket);
+        return true;
+    }
+
+    bool add(int fd) override {
+        Socket& socket = slot(fd);
+        if (socket.active) return true;
+        socket.active = true;
+        socket.watchOnly = false;
+        arm(fd, socket);
+        return true;
+    }
+
+    // Cancelled by user_data, so this stays valid after the caller closed fd
+    void remove(int fd) override {
+        Socket& socket = slot(fd);
+        if (!socket.active) return;
+        cancel(userData(socket.watchOnly || !receiveInKernel ? Poll : Receive, socket.generation, fd));
+        if (socket.waitingWritable) {
+            cancel(userData(PollOut, socket.generation, fd));
+        }
+        if (socket.sendQueued) {
+            for (PendingSend& pending : pendingSends) {
+                if (pending.fd == fd) pending.outbox = nullptr;
+            }
+        }
+        uint32_t generation = socket.generation;
+        socket = Socket();
+        socket.generation = (generation + 1) & 0xFFFFFF;
+        if (acceptStalled) {
+            acceptStalled = false;
+            armAccept();
+        }
+    }
+
+    void send(int fd, Outbox& outbox, MessagePool& pool) override {
+        Socket& socket = slot(fd);
+        if (socket.sendQueued || socket.waitingWritable) return; // Writable comes first
+        socket.sendQueued = true;
+        PendingSend& pending = pendingSends.emplace_back();
+        pending.fd = fd;
+        pending.outbox = &outbox;
+        pending.pool = &pool;
+    }
+
+    void submitSends() override {
+        while (!pendingSends.empty()) {
+            sendsLeft = 0;
+            for (size_t i = 0; i < pendingSends.size(); ++i) {
+                PendingSend& pending = pendingSends[i];
+                pending.length = 0;
+                if (!pending.outbox || pending.outbox->empty()) continue;
+
+                int count = pending.outbox->prepare(pending.segments, Outbox::kMaxSegments);
+                for (int segment = 0; segment < count; ++segment) {
+                    pending.length += pending.segments[segment].iov_len;
+                }
+                pending.header = {};
+                pending.header.msg_iov = pending.segments;
+                pending.header.msg_iovlen = count;
+
+                struct io_uring_sqe* sqe = nextSqe();
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = pending.fd;
+                sqe->addr = reinterpret_cast<uint64_t>(&pending.header);
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+                sqe->user_data = userData(Send, 0, i);
+                sendsLeft++;
+            }
+            while (sendsLeft > 0) {
+                enter(true, -1);
+                reap(stash);
+            }
+
+            // Outboxes with more than one write's worth of messages go again, the rest are done
+            size_t kept = 0;
+            for (PendingSend& pending : pendingSends) {
+                if (!pending.outbox) continue;
+                bool again = false;
+                if (pending.length > 0) {
+                    ssize_t result = pending.result < 0 ? -1 : pending.result;
+                    Outbox::FlushStatus status = sent(*pending.outbox, *pending.pool, result, -pending.result);
+                    Socket& socket = sockets[pending.fd];
+                    if (status == Outbox::FlushStatus::Blocked ||
+                        (result >= 0 && static_cast<size_t>(result) < pending.length)) {
+                        socket.waitingWritable = true;
+                        armPoll(pending.fd, socket, POLLOUT, false);
+                    } else {
+                        again = status == Outbox::FlushStatus::Flushed && !pending.outbox->empty();
+                    }
+                }
+                if (again) {
+                    pendingSends[kept].fd = pending.fd;
+                    pendingSends[kept].outbox = pending.outbox;
+                    pendingSends[kept].pool = pending.pool;
+                    kept++;
+                } else {
+                    sockets[pending.fd].sendQueued = false;
+                }
+            }
+            pendingSends.resize(kept);
+        }
+    }
+
+    int wait(int timeoutMs) override {
+        // The events handed out last time are done with, their buffers can be reused
+        for (const TransportEvent& event : events) {
+            if (event.type == TransportEvent::Type::Received) {
+                recycleBuffer((event.data - buffers.data()) / kBufferSize);
+            }
+        }
+        events.clear();
+        events.swap(stash);
+        for (const auto& [fd, generation] : rearm) {
+            if (sockets[fd].active && sockets[fd].generation == generation) {
+                arm(fd, sockets[fd]);
+            }
+        }
+        rearm.clear();
+
+        int result = enter(events.empty(), timeoutMs);
+        if (result < 0 && result != -ETIME && result != -EINTR && result != -EBUSY && result != -EAGAIN) {
+            LOG_WARNING("io_uring_enter failed: ", std::strerror(-result));
+        }
+        reap(events);
+        return events.size();
+    }
+
+    ~IoUringTransport() {
+        if (ringFd >= 0) close(ringFd);
+        if (bufferRing != MAP_FAILED) munmap(bufferRing, bufferRingSize);
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    }
+};